@@ -11,6 +11,7 @@
 #include <openssl/sha.h>
 #include <emmintrin.h>
 #include <smmintrin.h>
+#include <immintrin.h>
 #include <iomanip>
 #include <fstream>
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 #include <queue>
 #include <unordered_map>
 #include <bitset>
+#include <thread>
 #include <omp.h>
 #include "index.h"
 #include "io.h"
@@ -68,8 +70,16 @@ struct heap_entry_t {
 	uint32_t len;
 	uint16_t tid;
 	uint16_t next_idx;
+	uint32_t next_byte; // packed layout: offset of the next entry in the bucket
 };
 
+// per-thread scratch buffers of phase 1 (reused across the reads)
+typedef struct {
+	std::vector<minhash_t> kmer_hashes;
+	std::vector<heap_entry_t> heap;
+	std::vector<minhash_t> oph_bins;
+} minhash_scratch_t;
+
 void heap_sort(heap_entry_t* heap, int n) {
 	heap_entry_t tmp;
 	int i, j;
@@ -161,12 +171,177 @@ inline void heap_update_memmove(heap_entry_t* heap, uint32 n) {
 	}
 }
 
-int get_next_contig(const ref_t& ref, const std::vector<std::pair<uint64, minhash_t> >& ref_bucket_matches_by_table, uint32 t, heap_entry_t* entry) {
+#define BUCKET_DIR_SCAN_SIZE 16
+
+// decodes the next entry of the packed bucket that matches the read projection hash value
+int get_next_contig_packed(const ref_t& ref, const minhash_t read_proj_hash, const uint64 bid, uint32 t, heap_entry_t* entry) {
+	const uint64 bucket_size = ref.index.bucket_offsets[bid+1] - ref.index.bucket_offsets[bid];
+	const uint8* bucket = ref.index.packed_data + ref.index.bucket_byte_offsets[bid];
+	const uint8* p;
+	minhash_t hash;
+	seq_t pos;
+	uint32 idx = entry->next_idx;
+	if(idx == 0) {
+		// the first matching entry is in the last block that starts with a smaller hash or the block after it
+		const uint32 n_blocks = (bucket_size + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+		uint32 lo = 0;
+		uint32 hi = n_blocks;
+		while(lo < hi) {
+			const uint32 mid = (lo + hi) / 2;
+			if(packed_bucket_block(bucket, mid).hash < read_proj_hash) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if(n_blocks == 0) {
+			return 0;
+		}
+		idx = (lo > 0) ? (lo - 1)*PACKED_BLOCK_SIZE : 0;
+		hash = 0;
+		pos = 0;
+		p = NULL;
+		while(true) {
+			if(idx % PACKED_BLOCK_SIZE == 0) {
+				const packed_block_t block = packed_bucket_block(bucket, idx / PACKED_BLOCK_SIZE);
+				hash = block.hash;
+				pos = block.pos;
+				p = bucket + block.byte_offset;
+			} else {
+				const minhash_t hash_delta = varint_decode(p);
+				hash += hash_delta;
+				pos = (hash_delta == 0) ? pos + varint_decode(p) : fixed_decode(p, ref.index.packed_pos_bytes);
+			}
+			entry->len = varint_decode(p);
+			if(hash >= read_proj_hash) break;
+			idx++;
+			if(idx == bucket_size) return 0;
+		}
+		if(hash != read_proj_hash) {
+			return 0;
+		}
+	} else {
+		if(idx == bucket_size) {
+			return 0;
+		}
+		if(idx % PACKED_BLOCK_SIZE == 0) {
+			const packed_block_t block = packed_bucket_block(bucket, idx / PACKED_BLOCK_SIZE);
+			if(block.hash != read_proj_hash) {
+				return 0;
+			}
+			pos = block.pos;
+			p = bucket + block.byte_offset;
+		} else {
+			p = bucket + entry->next_byte;
+			if(varint_decode(p) != 0) { // hash changed
+				return 0;
+			}
+			pos = entry->pos + varint_decode(p);
+		}
+		entry->len = varint_decode(p);
+	}
+	entry->pos = pos;
+	entry->tid = t;
+	entry->next_idx = idx + 1;
+	entry->next_byte = p - bucket;
+	return 1;
+}
+
+// --- SoA bucket hash search ---
+// index of the first hash >= key in the sorted hash column of a bucket:
+// binary search down to a few vectors, then compare-and-movemask over the remaining hashes
+// (the hashes are unsigned: the sign bit is flipped to use the signed vector comparisons)
+#define SOA_SCAN_SIZE 64
+
+uint32 hash_lower_bound_sse(const minhash_t* hashes, uint32 size, const minhash_t key) {
+	uint32 lo = 0;
+	uint32 hi = size;
+	while(hi - lo > SOA_SCAN_SIZE) {
+		const uint32 mid = (lo + hi) / 2;
+		if(hashes[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	const __m128i sign = _mm_set1_epi32(0x80000000);
+	const __m128i k = _mm_xor_si128(_mm_set1_epi32(key), sign);
+	uint32 i = lo;
+	for(; i + 4 <= hi; i += 4) {
+		const __m128i h = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (hashes + i)), sign);
+		const int lt_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, h)));
+		if(lt_mask != 0xF) {
+			return i + __builtin_ctz(~lt_mask);
+		}
+	}
+	while(i < hi && hashes[i] < key) {
+		i++;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+uint32 hash_lower_bound_avx2(const minhash_t* hashes, uint32 size, const minhash_t key) {
+	uint32 lo = 0;
+	uint32 hi = size;
+	while(hi - lo > SOA_SCAN_SIZE) {
+		const uint32 mid = (lo + hi) / 2;
+		if(hashes[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	const __m256i sign = _mm256_set1_epi32(0x80000000);
+	const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+	uint32 i = lo;
+	for(; i + 8 <= hi; i += 8) {
+		const __m256i h = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (hashes + i)), sign);
+		const int lt_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, h)));
+		if(lt_mask != 0xFF) {
+			return i + __builtin_ctz(~lt_mask);
+		}
+	}
+	while(i < hi && hashes[i] < key) {
+		i++;
+	}
+	return i;
+}
+
+typedef uint32 (*hash_lower_bound_t)(const minhash_t* hashes, uint32 size, const minhash_t key);
+static const hash_lower_bound_t hash_lower_bound = __builtin_cpu_supports("avx2") ? hash_lower_bound_avx2 : hash_lower_bound_sse;
+
+// returns the next entry of the SoA bucket that matches the read projection hash value
+// (only the hash column is touched until a match is found)
+int get_next_contig_soa(const ref_t& ref, const minhash_t read_proj_hash, const uint64 bid, uint32 t, heap_entry_t* entry) {
+	const uint64 bucket_data_offset = ref.index.bucket_offsets[bid];
+	const uint32 bucket_data_size = ref.index.bucket_offsets[bid+1] - bucket_data_offset;
+	const minhash_t* hashes = ref.index.bucket_hashes + bucket_data_offset;
+	if(entry->next_idx == 0) {
+		entry->next_idx = hash_lower_bound(hashes, bucket_data_size, read_proj_hash);
+	}
+	if(entry->next_idx < bucket_data_size && hashes[entry->next_idx] == read_proj_hash) {
+		entry->pos = ref.index.bucket_pos[bucket_data_offset + entry->next_idx];
+		entry->len = ref.index.bucket_lens[bucket_data_offset + entry->next_idx];
+		entry->tid = t;
+		entry->next_idx++;
+		return 1;
+	}
+	return 0;
+}
+
+int get_next_contig(const ref_t& ref, const std::pair<uint64, minhash_t>* ref_bucket_matches_by_table, uint32 t, heap_entry_t* entry) {
 	const minhash_t read_proj_hash = ref_bucket_matches_by_table[t].second;
 	const uint64 bid = ref_bucket_matches_by_table[t].first;
-	if(bid == ref.index.bucket_offsets.size()) { // table ignored
+	if(bid == ref.index.n_bucket_offsets) { // table ignored
 		return 0;
 	}
+	if(ref.index.layout == IDX_LAYOUT_PACKED) {
+		return get_next_contig_packed(ref, read_proj_hash, bid, t, entry);
+	}
+	if(ref.index.layout == IDX_LAYOUT_SOA) {
+		return get_next_contig_soa(ref, read_proj_hash, bid, t, entry);
+	}
 	const uint64 bucket_data_offset = ref.index.bucket_offsets[bid];
 	const uint64 bucket_data_size = ref.index.bucket_offsets[bid+1] - bucket_data_offset;
 
@@ -175,16 +350,38 @@ int get_next_contig(const ref_t& ref, const std::vector<std::pair<uint64, minhas
 
 	// get the next entry in the bucket that matches the read projection hash value
 	bool first = entry->next_idx == 0;
-	if(first) {
+	if(first && ref.index.bucket_dir_offsets != NULL) {
+		// find the hash run in the bucket hash directory (binary search down to a few entries, then scan)
+		const minhash_t* dir_hashes = ref.index.dir_hashes + ref.index.bucket_dir_offsets[bid];
+		const uint64 dir_size = ref.index.bucket_dir_offsets[bid+1] - ref.index.bucket_dir_offsets[bid];
+		uint64 lo = 0;
+		uint64 hi = dir_size;
+		while(hi - lo > BUCKET_DIR_SCAN_SIZE) {
+			const uint64 mid = (lo + hi) / 2;
+			if(dir_hashes[mid] < read_proj_hash) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		while(lo < hi && dir_hashes[lo] < read_proj_hash) {
+			lo++;
+		}
+		if(lo == dir_size || dir_hashes[lo] != read_proj_hash) {
+			return 0;
+		}
+		entry->next_idx = ref.index.dir_starts[ref.index.bucket_dir_offsets[bid] + lo];
+	} else if(first) {
 		loc_t l;
 		l.hash = read_proj_hash;
 		l.pos = 0;
 		l.len = 0;
-		std::vector<loc_t>::const_iterator range_start = std::lower_bound(ref.index.buckets_data.begin() + bucket_data_offset, ref.index.buckets_data.begin() + bucket_data_offset + bucket_data_size, l, comp_loc()); 	
-		entry->next_idx = std::distance(ref.index.buckets_data.begin() + bucket_data_offset, range_start);
+		const loc_t* range_start = std::lower_bound(ref.index.buckets_data + bucket_data_offset, ref.index.buckets_data + bucket_data_offset + bucket_data_size, l, comp_loc());
+		entry->next_idx = std::distance(ref.index.buckets_data + bucket_data_offset, range_start);
 	}
 	//while(entry->next_idx < bucket_data_size) {
-		if(ref.index.buckets_data[bucket_data_offset + entry->next_idx].hash == read_proj_hash) {
+		// (the bucket end must be checked: the entries past it belong to the next bucket or past the mapped index)
+		if(entry->next_idx < bucket_data_size && ref.index.buckets_data[bucket_data_offset + entry->next_idx].hash == read_proj_hash) {
 			entry->pos = ref.index.buckets_data[bucket_data_offset + entry->next_idx].pos;
 			entry->len = ref.index.buckets_data[bucket_data_offset + entry->next_idx].len;
 			entry->tid = t;
@@ -200,7 +397,7 @@ int get_next_contig(const ref_t& ref, const std::vector<std::pair<uint64, minhas
 }
 
 #define CONTIG_PADDING 50
-void process_merged_contig(seq_t contig_pos, uint32 contig_len, int n_diff_table_hits, const ref_t& ref, read_t* r, const bool rc, const index_params_t* params) {
+void process_merged_contig(seq_t contig_pos, uint32 contig_len, int n_diff_table_hits, const ref_t& ref, read_t* r, VectorRefMatches& matches, const bool rc, const index_params_t* params) {
 #if(SIM_EVAL)
 	 if(pos_in_range_asym(r->ref_pos_r, contig_pos, contig_len + params->ref_window_size, params->ref_window_size) ||
 		pos_in_range_asym(r->ref_pos_l, contig_pos, contig_len + params->ref_window_size, params->ref_window_size))  {
@@ -223,7 +420,8 @@ void process_merged_contig(seq_t contig_pos, uint32 contig_len, int n_diff_table
 	const seq_t padded_hit_offset = (hit_offset >= CONTIG_PADDING) ? hit_offset - CONTIG_PADDING : 0;
 	const uint32 search_len = contig_len + 2*CONTIG_PADDING + r->len;
 	ref_match_t rm(padded_hit_offset, search_len, rc, n_diff_table_hits);
-	r->ref_matches.push_back(rm);
+	matches.push_back(rm);
+	r->n_ref_matches++;
 	r->n_proc_contigs++;
 
 	/* ---- split the ref contig
@@ -248,12 +446,11 @@ void process_merged_contig(seq_t contig_pos, uint32 contig_len, int n_diff_table
 }
 
 #define N_TABLES_MAX 1024
-// output matches (ordered by the number of projections matched)
-void collect_read_hits(const ref_t& ref, read_t* r, const bool rc, const index_params_t* params) {
-	r->ref_matches.reserve(10);
-
+// output matches (ordered by the number of projections matched), appended to the given arena
+void collect_read_hits(const ref_t& ref, read_t* r, VectorRefMatches& matches, const bool rc, const index_params_t* params, minhash_scratch_t& scratch) {
 	// priority heap of matched positions
-	heap_entry_t heap[params->n_tables];
+	scratch.heap.resize(params->n_tables);
+	heap_entry_t* heap = scratch.heap.data();
 	int heap_size = 0;
 	// push the first entries in each sorted bucket onto the heap
 	for(uint32 t = 0; t < params->n_tables; t++) { // for each table
@@ -286,7 +483,7 @@ void collect_read_hits(const ref_t& ref, read_t* r, const bool rc, const index_p
 			occ.set(e.tid);
 		} else {
 			// found a boundary, store/handle last contig
-			process_merged_contig(last_pos, len, n_diff_table_hits, ref, r, rc, params);
+			process_merged_contig(last_pos, len, n_diff_table_hits, ref, r, matches, rc, params);
 
 			// start a new contig
 			n_diff_table_hits = 1;
@@ -307,7 +504,7 @@ void collect_read_hits(const ref_t& ref, read_t* r, const bool rc, const index_p
 
 	// add the last position
 	if(last_pos != (seq_t) -1) {
-		process_merged_contig(last_pos, len, n_diff_table_hits, ref, r, rc, params);
+		process_merged_contig(last_pos, len, n_diff_table_hits, ref, r, matches, rc, params);
 	}
 }
 
@@ -493,12 +690,25 @@ void propagate_matches(read_t* r, const int contig_pos,
 	//std::cout << " inliers[0] " << kmer_inliers[0] << " inliers[1] " << kmer_inliers[1] << " min_match[0] " << min_match[0] << " min_match[1] " << min_match[1] << "\n";
 }
 
+// per-thread scratch buffers of the voting loops (reused across the reads and contigs)
+typedef struct {
+	std::vector<std::pair<kmer_cipher_t, pos_cipher_t>> read_kmers_f;
+	std::vector<std::pair<kmer_cipher_t, pos_cipher_t>> read_kmers_rc;
+	std::vector<std::pair<kmer_cipher_t, pos_cipher_t>> contig_kmers;
+	std::vector<kmer_cipher_t> contig_ciphers;
+	std::vector<int> votes;
+	std::vector<int> votes_prefsum;
+	std::vector<std::pair<kmer_cipher_t, pos_cipher_t>> read_kmers_sorted;
+	std::vector<int> kmer_first_occ;
+} vote_scratch_t;
+
 static int max_repeats = 0;
 static int max_repeats_contig = 0;
 static std::vector<int> n_repeats_v;
 static std::vector<int> n_repeats_v_contig;
 
-void generate_voting_kmer_ciphers_read(kmer_cipher_t* ciphers, const char* seq, const seq_t seq_len, const uint64 key1, const uint64 key2, const ref_t& ref, const index_params_t* params) {
+void generate_voting_kmer_ciphers_read(kmer_cipher_t* ciphers, const char* seq, const seq_t seq_len, const uint64 key1, const uint64 key2, const ref_t& ref, const index_params_t* params,
+		vote_scratch_t& scratch) {
 
 	const int n_kmers = seq_len - params->k2 + 1;
     	uint32_t hash[5];
@@ -524,12 +734,23 @@ void generate_voting_kmer_ciphers_read(kmer_cipher_t* ciphers, const char* seq,
                 ciphers[i] *= key2;
         }
 	
-	std::unordered_map<kmer_cipher_t, int> s;
-	std::pair<std::unordered_map<kmer_cipher_t, int>::iterator, bool> r;
+	// mask the repeated kmers: each repeat and its first occurrence get random ciphers
+	std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& sorted = scratch.read_kmers_sorted;
+	std::vector<int>& first_occ = scratch.kmer_first_occ;
+	sorted.resize(n_kmers);
+	first_occ.assign(n_kmers, -1);
 	for(int i = 0; i < n_kmers; i++) {
-		r = s.insert(std::make_pair(ciphers[i], i));
-		if(!r.second) {
-			ciphers[(r.first)->second] = genrand64_int64();
+		sorted[i] = std::make_pair(ciphers[i], i);
+	}
+	std::sort(sorted.begin(), sorted.end());
+	for(int i = 1; i < n_kmers; i++) {
+		if(sorted[i].first == sorted[i-1].first) {
+			first_occ[sorted[i].second] = (first_occ[sorted[i-1].second] == -1) ? sorted[i-1].second : first_occ[sorted[i-1].second];
+		}
+	}
+	for(int i = 0; i < n_kmers; i++) {
+		if(first_occ[i] != -1) {
+			ciphers[first_occ[i]] = genrand64_int64();
 			ciphers[i] = genrand64_int64();
 		}
 	}
@@ -549,7 +770,9 @@ void generate_voting_kmer_ciphers_ref(kmer_cipher_t* ciphers, const char* seq, c
 			ciphers[i/params->sampling_intv] = (ciphers[i] ^ key1)*key2;
 		} else {
 			ciphers[i/params->sampling_intv] = genrand64_int64();
-                        ciphers[i+r] = 0;
+			if(i + r < n_kmers) {
+				ciphers[i+r] = 0;
+			}
 		}
 	}
 #endif
@@ -935,10 +1158,11 @@ void vote_cast_and_count_chaining(const ref_match_t ref_contig, const seq_t rlen
 void vote_cast_and_count(const ref_match_t ref_contig, const seq_t rlen,
                 std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_ciphers,
                 std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& contig_ciphers,
-                const index_params_t* params, int* n_votes, int* pos) {
+                const index_params_t* params, vote_scratch_t& scratch, int* n_votes, int* pos) {
 
 	int approx_pos_range = params->k2;
-        std::vector<int> votes(ref_contig.len + rlen);
+        std::vector<int>& votes = scratch.votes;
+        votes.assign(ref_contig.len + rlen, 0);
         int pos0 = rlen;
         uint32 skip = 0;
         bool any_matches = false;
@@ -988,7 +1212,8 @@ void vote_cast_and_count(const ref_match_t ref_contig, const seq_t rlen,
 	if(!any_matches) return;
 
 	//std::cout << "VOTES: \n";
-        std::vector<int> votes_prefsum(ref_contig.len + rlen);
+        std::vector<int>& votes_prefsum = scratch.votes_prefsum;
+        votes_prefsum.resize(ref_contig.len + rlen);
         votes_prefsum[0] = votes[0];
 	for(int i = 1; i < votes.size(); i++) {
 		//std::cout << i << ":" << votes[i] << " ";
@@ -1040,212 +1265,336 @@ void vote_cast_and_count(const ref_match_t ref_contig, const seq_t rlen,
 }
 
 
-void store_precomp_contigs(const char* fileName, reads_t& reads) {
-	std::string fname(fileName);
-	std::ofstream file;
-	file.open(fname.c_str(), std::ios::out | std::ios::binary);
+void open_precomp_contigs(const char* fileName, std::ofstream& file) {
+	file.open(fileName, std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
-		printf("store_or_load_contigs: Cannot open file %s!\n", fname.c_str());
+		printf("store_or_load_contigs: Cannot open file %s!\n", fileName);
 		exit(1);
 	}
+}
+
+void open_precomp_contigs(const char* fileName, std::ifstream& file) {
+	file.open(fileName, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		printf("store_or_load_contigs: Cannot open file %s!\n", fileName);
+		exit(1);
+	}
+}
+
+// the contigs of consecutive read batches are appended to the same file
+void store_precomp_contigs(std::ofstream& file, read_batch_t& reads) {
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
-		uint32 ref_size = r->ref_matches.size();
-		file.write(reinterpret_cast<char*>(&ref_size), sizeof(r->ref_matches.size()));
-		file.write(reinterpret_cast<char*>(&(r->ref_matches[0])), r->ref_matches.size()*sizeof(ref_match_t));
+		uint32 ref_size = r->n_ref_matches;
+		file.write(reinterpret_cast<char*>(&ref_size), sizeof(ref_size));
+		file.write(reinterpret_cast<char*>(&(r->ref_matches[0])), r->n_ref_matches*sizeof(ref_match_t));
 	}
 }
-void load_precomp_contigs(const char* fileName, reads_t& reads) {
-	std::string fname(fileName);
-	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
-		printf("store_or_load_contigs: Cannot open file %s!\n", fname.c_str());
-		exit(1);
+void load_precomp_contigs(std::ifstream& file, read_batch_t& reads) {
+	if(reads.ref_matches.size() == 0) {
+		reads.ref_matches.resize(1);
 	}
+	VectorRefMatches& matches = reads.ref_matches[0];
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
 		uint32 ref_size;
-		file.read(reinterpret_cast<char*>(&ref_size), sizeof(r->ref_matches.size()));
-		r->ref_matches.resize(ref_size);
-		file.read(reinterpret_cast<char*>(&(r->ref_matches[0])), r->ref_matches.size()*sizeof(ref_match_t));
+		file.read(reinterpret_cast<char*>(&ref_size), sizeof(ref_size));
+		r->ref_matches_arena = 0;
+		r->ref_matches_offset = matches.size();
+		r->n_ref_matches = ref_size;
+		matches.resize(matches.size() + ref_size);
+		file.read(reinterpret_cast<char*>(matches.data() + r->ref_matches_offset), ref_size*sizeof(ref_match_t));
 		r->n_proc_contigs = ref_size;
-		for(uint32 j = 0; j < r->ref_matches.size(); j++) {
-			ref_match_t ref_contig = r->ref_matches[j];
+		for(uint32 j = 0; j < r->n_ref_matches; j++) {
+			ref_match_t ref_contig = matches[r->ref_matches_offset + j];
 			if(ref_contig.n_diff_bucket_hits > r->best_n_bucket_hits) {
 				r->best_n_bucket_hits = ref_contig.n_diff_bucket_hits;
 			}
 		}
 	}
+	reads.attach_ref_matches();
 }
 
 #define MAX_BUCKET_SIZE 1000
+#define PHASE1_CHUNK_SIZE 64 // reads per dynamically scheduled phase 1 work unit
+#define PROBE_OFFSETS_DIST 4 // pipeline distance (in reads) of the bucket offset prefetches
+#define PROBE_HEADS_DIST 2 // pipeline distance (in reads) of the bucket head prefetches
+
+// first bucket probe stage: projects the sketch onto each table and prefetches the bucket offsets
+inline void probe_bucket_offsets(const ref_t& ref, const minhash_t* minhashes, std::pair<uint64, minhash_t>* bucket_matches, const index_params_t* params) {
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(minhashes, params->sketch_proj_indices, t*params->sketch_proj_len);
+		const uint64 bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
+		bucket_matches[t] = std::pair<uint64, minhash_t>(bid, proj_hash);
+		ref.index.prefetch_bucket_offsets(bid);
+	}
+}
+
+// second bucket probe stage: drops the oversized buckets and prefetches the heads of the rest
+// (returns true if any bucket is kept)
+inline bool probe_bucket_heads(const ref_t& ref, std::pair<uint64, minhash_t>* bucket_matches, const index_params_t* params) {
+	bool any_kept = false;
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		const uint64 bid = bucket_matches[t].first;
+		const uint32 bucket_size = ref.index.bucket_offsets[bid + 1] - ref.index.bucket_offsets[bid];
+		if(bucket_size > MAX_BUCKET_SIZE) {
+			bucket_matches[t] = std::pair<uint64, minhash_t>(ref.index.n_bucket_offsets, 0);
+			continue;
+		}
+		any_kept = true;
+		ref.index.prefetch_bucket_head(bid);
+	}
+	return any_kept;
+}
 //#define KMER_MASK_LEN 20
 //static const uint8 kmer_mask[KMER_MASK_LEN] = {1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1};
 static const int VERBOSE = (getenv("VERBOSE") ? atoi(getenv("VERBOSE")) : 0);
 
 //////////// PRIVACY-PRESERVING READ ALIGNMENT ////////////
 
-void phase1_minhash(const ref_t& ref, reads_t& reads, const index_params_t* params);
-void phase1_merge(reads_t& reads, const ref_t& ref, const index_params_t* params);
-void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* params);
-void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* params, int* avg_score);
-void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* params, int* avg_score);
-void finalize(reads_t& reads, const uint32 avg_score, const ref_t& ref, const index_params_t* params);
-void eval(reads_t& reads, const ref_t& ref, const index_params_t* params);
-
-void balaur_main(const char* fastaName, ref_t& ref, reads_t& reads, const index_params_t* params) {
-	get_sim_read_info(ref, reads);
+// sum and number of the non-zero top alignment votes, accumulated over the read batches
+// (their average is used to scale the mapping qualities)
+typedef struct {
+	uint64 sum_score;
+	uint64 n_nonzero_scores;
+} vote_stats_t;
+
+void phase1_minhash(const ref_t& ref, read_batch_t& reads, const index_params_t* params);
+void phase1_merge(read_batch_t& reads, const ref_t& ref, const index_params_t* params);
+void phase2_encryption(read_batch_t& reads, const ref_t& ref, const index_params_t* params);
+void phase2_voting(read_batch_t& reads, const ref_t& ref, const index_params_t* params, vote_stats_t* vote_stats);
+void phase2_monolith(read_batch_t& reads, const ref_t& ref, const index_params_t* params, vote_stats_t* vote_stats);
+void finalize(FILE* samFile, read_batch_t& reads, const uint32 avg_score, const ref_t& ref, const index_params_t* params);
+void eval(read_batch_t& reads, const ref_t& ref, const index_params_t* params);
+
+#define STREAM_PARSE_THREAD_SHARE 8
+
+// aligns the reads one batch at a time, appending the alignments to the SAM file
+// in streaming mode (read_batch_size > 0) the next batch is parsed while the current one is aligned,
+// the index and the phase 2 reference data stay loaded for all the batches;
+// otherwise all the reads form one batch and the index is released after phase 1
+// note: the mapping qualities are scaled by the average votes of the batches aligned so far
+void balaur_main(const char* fastaName, const char* readsFname, ref_t& ref, const index_params_t* all_params) {
+	const bool streaming = (all_params->read_batch_size > 0);
+	const uint32 max_batch_reads = streaming ? all_params->read_batch_size : UINT32_MAX;
+	fastq_reader_t reader;
+	if (!reader.open(readsFname)) {
+		printf("load_reads_fastq: Cannot open reads file: %s !\n", readsFname);
+		exit(1);
+	}
+	read_batch_t batches[2];
+	uint32 curr = 0;
+	reader.n_threads = all_params->n_threads;
+	reader.next_batch(batches[curr], max_batch_reads);
+
+	// in streaming mode the thread budget is split between the background parse of the next batch
+	// and the alignment of the current one (parsing is much cheaper and gets 1/STREAM_PARSE_THREAD_SHARE of the threads)
+	index_params_t align_params = *all_params;
+	if(streaming) {
+		reader.n_threads = std::max(1U, all_params->n_threads / STREAM_PARSE_THREAD_SHARE);
+		if(all_params->n_threads > reader.n_threads) {
+			align_params.n_threads = all_params->n_threads - reader.n_threads;
+		}
+	}
+	const index_params_t* params = &align_params;
 
-	// --- phase 1 ---
-	double start_time = omp_get_wtime();
-	phase1_minhash(ref, reads, params);
+	FILE* samFile = open_sam_file(readsFname);
+	std::ofstream contigs_out;
+	std::ifstream contigs_in;
 	if(params->load_mhi) {
-		ref.index.release();
 		if(params->precomp_contig_file_name.size() != 0) {
-			store_precomp_contigs(params->precomp_contig_file_name.c_str(), reads);
+			open_precomp_contigs(params->precomp_contig_file_name.c_str(), contigs_out);
 		}
 	} else {
-		load_precomp_contigs(params->precomp_contig_file_name.c_str(), reads);
+		open_precomp_contigs(params->precomp_contig_file_name.c_str(), contigs_in);
 	}
 
-	// --- phase 2 ---
-	int avg_score;
-	load_kmer2_hashes(fastaName, ref, params);
-	load_repeat_info(fastaName, ref, params);
-	//load_repeat_local(fastaName, ref, params);
-	if(!params->monolith) {
-		phase2_encryption(reads, ref, params);
-		phase2_voting(reads, ref, params, &avg_score);
-	} else {
-		phase2_monolith(reads, ref, params, &avg_score);
+	double start_time = omp_get_wtime();
+	if(streaming) {
+		load_kmer2_hashes(fastaName, ref, params);
+		load_repeat_info(fastaName, ref, params);
+	}
+	vote_stats_t vote_stats = {0, 0};
+	uint32 n_batches = 0;
+	uint64 n_reads = 0;
+	while(batches[curr].reads.size() > 0) {
+		read_batch_t& reads = batches[curr];
+		std::thread next_batch_parser;
+		if(streaming) {
+			next_batch_parser = std::thread(&fastq_reader_t::next_batch, &reader, std::ref(batches[1 - curr]), max_batch_reads);
+			printf("////////////// Batch %u: %zu reads //////////////\n", n_batches, reads.reads.size());
+		} else {
+			batches[1 - curr].clear();
+		}
+		get_sim_read_info(ref, reads);
+
+		// --- phase 1 ---
+		phase1_minhash(ref, reads, params);
+		if(params->load_mhi) {
+			if(!streaming) ref.index.release();
+			if(contigs_out.is_open()) {
+				store_precomp_contigs(contigs_out, reads);
+			}
+		} else {
+			load_precomp_contigs(contigs_in, reads);
+		}
+
+		// --- phase 2 ---
+		if(!streaming) {
+			load_kmer2_hashes(fastaName, ref, params);
+			load_repeat_info(fastaName, ref, params);
+			//load_repeat_local(fastaName, ref, params);
+		}
+		if(!params->monolith) {
+			phase2_encryption(reads, ref, params);
+			phase2_voting(reads, ref, params, &vote_stats);
+		} else {
+			phase2_monolith(reads, ref, params, &vote_stats);
+		}
+		const uint32 avg_score = vote_stats.n_nonzero_scores > 0 ? vote_stats.sum_score/vote_stats.n_nonzero_scores : 0;
+		finalize(samFile, reads, avg_score, ref, params);
+		eval(reads, ref, params);
+
+		n_batches++;
+		n_reads += reads.reads.size();
+		if(next_batch_parser.joinable()) {
+			next_batch_parser.join();
+		}
+		curr = 1 - curr;
+	}
+	fclose(samFile);
+	if(streaming) {
+		printf("Aligned %llu reads in %u batches\n", n_reads, n_batches);
 	}
-	finalize(reads, avg_score, ref, params);
-	eval(reads, ref, params);
 	printf("****TOTAL ALIGNMENT TIME****: %.2f sec\n", omp_get_wtime() - start_time);	
 }
 
 
-bool minhash_opt(const char* seq, const seq_t seq_len,
-                        const VectorBool& ref_freq_kmer_bitmap,
+// fingerprints both strands of the read in a single pass over the forward sequence
+// (the reverse complement kmers are maintained alongside the forward ones)
+void minhash_opt_dual(const char* seq, const seq_t seq_len,
+                        const freq_kmer_filter_t& ref_freq_kmer_filter,
                         const index_params_t* params,
-                        VectorMinHash& min_hashes) {
-
-        minhash_t v[seq_len - params->k + 1]  __attribute__((aligned(16)));;
-        uint32 n_valid_kmers = 0;
-        for(uint32 i = 0; i < seq_len - params->k + 1; i++) {
-                uint32_t packed_kmer;
-                if((pack_32(&seq[i], params->k, &packed_kmer) < 0) || ref_freq_kmer_bitmap[packed_kmer]) {
-                        continue;
+                        minhash_t* min_hashes_f, minhash_t* min_hashes_rc,
+                        bool* valid_f, bool* valid_rc, minhash_scratch_t& scratch) {
+
+        const uint32 n_kmers = seq_len - params->k + 1;
+        scratch.kmer_hashes.resize(2*(n_kmers + MINHASH_KERNEL_PAD));
+        minhash_t* v_f = scratch.kmer_hashes.data();
+        minhash_t* v_rc = v_f + n_kmers + MINHASH_KERNEL_PAD;
+        uint32 n_valid_kmers_f = 0;
+        uint32 n_valid_kmers_rc = 0;
+        dual_kmer_iter_t kmer_iter(seq, params->k);
+        for(uint32 i = 0; i < n_kmers; i++) {
+                if(i == 0) {
+                        kmer_iter.reset(0);
+                } else {
+                        kmer_iter.next();
                 }
-                v[n_valid_kmers] = CityHash32(&seq[i], params->k); //packed_kmer;
-                n_valid_kmers++;
-        }
-        if(n_valid_kmers <= 2*params->k) {
-                return false;
-        }
-
-        __m128i* vs = (__m128i*)v;
-        __m128i scalar, p1, curr_min_vec;
-        for(uint32_t h = 0; h < params->h; h++) { // update the min values
-                const minhash_t s = params->minhash_functions[h].a;
-                scalar = _mm_set1_epi32(s);
-                curr_min_vec = _mm_mullo_epi32(vs[0], scalar);
-                for(uint32 i = 1; i < n_valid_kmers/4; i++) {
-                        p1 = _mm_mullo_epi32(vs[i], scalar);
-                        curr_min_vec = _mm_min_epu32(p1, curr_min_vec);
+                if(!kmer_iter.valid()) {
+                        continue;
                 }
-                minhash_t result[4] __attribute__((aligned(16)));
-                _mm_store_si128((__m128i*)result, curr_min_vec);
-                min_hashes[h] = result[0];
-                for(int i = 1; i < 4; i++) {
-                        if(result[i] < min_hashes[h]) {
-                                min_hashes[h] = result[i];
-                        }
+                // the filter holds the reference strand kmers: each strand is looked up separately
+                const uint32 kmer_f = kmer_iter.packed();
+                const uint32 kmer_rc = kmer_iter.packed_rc();
+                if(!ref_freq_kmer_filter.contains(kmer_f)) {
+                        v_f[n_valid_kmers_f] = params->kmer_hasher->encrypt_packed_kmer(kmer_f);
+                        n_valid_kmers_f++;
                 }
-
-                for(int i = 4*(n_valid_kmers/4); i < n_valid_kmers; i++) {
-                        const minhash_t p = s*v[i];
-                        if(p < min_hashes[h]) {
-                                 min_hashes[h] = p;
-                        }
+                if(!ref_freq_kmer_filter.contains(kmer_rc)) {
+                        v_rc[n_valid_kmers_rc] = params->kmer_hasher->encrypt_packed_kmer(kmer_rc);
+                        n_valid_kmers_rc++;
                 }
         }
-
-	/*std::vector<minhash_t> min_hashes2(n_valid_kmers);
-        for(uint32_t h = 0; h < params->h; h++) { // update the min values
-                const minhash_t s = params->minhash_functions[h].a;
-                min_hashes2[h] = s*v[0];
-                for(uint32 i = 1; i < n_valid_kmers; i++) {
-                        const minhash_t p = s*v[i];
-                        if(p < min_hashes2[h]) {
-                                min_hashes2[h] = p;
-                        }
-                }
-        }*/
-
-        return true;
+        *valid_f = n_valid_kmers_f > 2*params->k;
+        *valid_rc = n_valid_kmers_rc > 2*params->k;
+        scratch.oph_bins.resize(params->h);
+        if(*valid_f) {
+                minhash_sketch(v_f, n_valid_kmers_f, params, scratch.oph_bins.data(), min_hashes_f);
+        }
+        if(*valid_rc) {
+                minhash_sketch(v_rc, n_valid_kmers_rc, params, scratch.oph_bins.data(), min_hashes_rc);
+        }
 }
 
-void phase1_minhash(const ref_t& ref, reads_t& reads, const index_params_t* params) {
+void phase1_minhash(const ref_t& ref, read_batch_t& reads, const index_params_t* params) {
 	printf("////////////// Phase 1: MinHash //////////////\n");
 	omp_set_num_threads(params->n_threads);
 	double start_time = omp_get_wtime();
+	reads.minhashes.resize(2*params->h*reads.reads.size());
+	reads.bucket_matches.resize(2*params->n_tables*reads.reads.size());
+	if(reads.ref_matches.size() < (uint32) omp_get_max_threads()) {
+		reads.ref_matches.resize(omp_get_max_threads());
+	}
+
 	///// ---- fingerprints ----
-	//#pragma omp parallel for
+	#pragma omp parallel
+	{
+	minhash_scratch_t scratch;
+	#pragma omp for schedule(dynamic, PHASE1_CHUNK_SIZE)
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
-		r->minhashes_f.resize(params->h);
-		r->minhashes_rc.resize(params->h);
-		r->valid_minhash_f = minhash_opt(r->seq.c_str(), r->len, ref.high_freq_kmer_bitmap, params, r->minhashes_f);
-		r->valid_minhash_rc = minhash_opt(r->rc.c_str(), r->len, ref.high_freq_kmer_bitmap, params, r->minhashes_rc);
+		r->minhashes_f = &reads.minhashes[2*params->h*i];
+		r->minhashes_rc = r->minhashes_f + params->h;
+		bool valid_f, valid_rc;
+		minhash_opt_dual(r->seq, r->len, ref.high_freq_kmer_filter, params, r->minhashes_f, r->minhashes_rc, &valid_f, &valid_rc, scratch);
+		r->valid_minhash_f = valid_f;
+		r->valid_minhash_rc = valid_rc;
+	}
 	}
 	printf("Runtime (fingerprints): %.2f sec\n", omp_get_wtime() - start_time);
 
 	if(!params->load_mhi) return;
 
 	///// ---- project and merge ----
-	//#pragma omp parallel for
-	for(uint32 i = 0; i < reads.reads.size(); i++) {
-		read_t* r = &reads.reads[i];
-		if(r->valid_minhash_f) {
-			r->ref_bucket_matches_by_table_f.resize(params->n_tables);
-			for(uint32 t = 0; t < params->n_tables; t++) {
-				const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(r->minhashes_f, params->sketch_proj_indices, t*params->sketch_proj_len);
-				const uint64_t bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
-				const uint32 bucket_size = ref.index.bucket_offsets[bid + 1] - ref.index.bucket_offsets[bid];
-				if(bucket_size > MAX_BUCKET_SIZE) {
-					r->ref_bucket_matches_by_table_f[t] = std::pair<uint64, minhash_t>(ref.index.bucket_offsets.size(), 0);
-					continue;
-				}
-				r->ref_bucket_matches_by_table_f[t] = std::pair<uint64, minhash_t>(bid, proj_hash);
-				//_mm_prefetch((const void *)&ref.index.buckets_data[ref.index.bucket_offsets[bid]],_MM_HINT_T0);
+	double start_time_lookup = omp_get_wtime();
+	const uint32 n_units = (reads.reads.size() + PHASE1_CHUNK_SIZE - 1)/PHASE1_CHUNK_SIZE;
+	#pragma omp parallel
+	{
+	minhash_scratch_t scratch;
+	VectorRefMatches& matches = reads.ref_matches[omp_get_thread_num()];
+	// the number of bucket hits to merge varies widely across the reads
+	#pragma omp for schedule(dynamic, 1)
+	for(uint32 u = 0; u < n_units; u++) {
+		const int64_t start = (int64_t) u*PHASE1_CHUNK_SIZE;
+		const int64_t end = std::min(start + PHASE1_CHUNK_SIZE, (int64_t) reads.reads.size());
+		// software pipeline over the reads of the work unit: the bucket offsets of a read are requested
+		// PROBE_OFFSETS_DIST reads before its hits are merged and the bucket heads PROBE_HEADS_DIST reads before
+		for(int64_t i = start; i < end + PROBE_OFFSETS_DIST; i++) {
+			if(i < end) {
+				read_t* r = &reads.reads[i];
+				r->ref_bucket_matches_by_table_f = &reads.bucket_matches[2*params->n_tables*i];
+				r->ref_bucket_matches_by_table_rc = r->ref_bucket_matches_by_table_f + params->n_tables;
+				if(r->valid_minhash_f) probe_bucket_offsets(ref, r->minhashes_f, r->ref_bucket_matches_by_table_f, params);
+				if(r->valid_minhash_rc) probe_bucket_offsets(ref, r->minhashes_rc, r->ref_bucket_matches_by_table_rc, params);
 			}
-			collect_read_hits(ref, r, false, params);
-		}
-		if(r->valid_minhash_rc) {
-			r->ref_bucket_matches_by_table_rc.resize(params->n_tables);
-			for(uint32 t = 0; t < params->n_tables; t++) {
-				const minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(r->minhashes_rc, params->sketch_proj_indices, t*params->sketch_proj_len);
-				const uint64_t bid = t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
-				uint32 bucket_size = ref.index.bucket_offsets[bid + 1] - ref.index.bucket_offsets[bid];
-				if(bucket_size > MAX_BUCKET_SIZE) {
-					r->ref_bucket_matches_by_table_rc[t] = std::pair<uint64, minhash_t>(ref.index.bucket_offsets.size(), 0);
-					continue;
+			const int64_t h = i - (PROBE_OFFSETS_DIST - PROBE_HEADS_DIST);
+			if(h >= start && h < end) {
+				read_t* r = &reads.reads[h];
+				if(r->valid_minhash_f) probe_bucket_heads(ref, r->ref_bucket_matches_by_table_f, params);
+				if(r->valid_minhash_rc && probe_bucket_heads(ref, r->ref_bucket_matches_by_table_rc, params)) {
+					r->any_bucket_hits = true;
 				}
-				r->any_bucket_hits = true;
-				r->ref_bucket_matches_by_table_rc[t] = std::pair<uint64, minhash_t>(bid, proj_hash);
-				//_mm_prefetch((const char *)&ref.index.buckets_data[ref.index.bucket_offsets[bid]],_MM_HINT_T0);
 			}
-			collect_read_hits(ref, r, true, params);
+			const int64_t m = i - PROBE_OFFSETS_DIST;
+			if(m >= start) {
+				read_t* r = &reads.reads[m];
+				r->ref_matches_arena = omp_get_thread_num();
+				r->ref_matches_offset = matches.size();
+				if(r->valid_minhash_f) collect_read_hits(ref, r, matches, false, params, scratch);
+				if(r->valid_minhash_rc) collect_read_hits(ref, r, matches, true, params, scratch);
+			}
 		}
 	}
+	}
+	reads.attach_ref_matches();
+	printf("Runtime (bucket lookups): %.2f sec\n", omp_get_wtime() - start_time_lookup);
 	printf("Runtime time (total): %.2f sec\n", omp_get_wtime() - start_time);
 }
 
-void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* params) {
+void phase2_encryption(read_batch_t& reads, const ref_t& ref, const index_params_t* params) {
 	printf("////////////// Phase 2: Contig Encryption //////////////\n");
 	omp_set_num_threads(params->n_threads);
 
@@ -1254,18 +1603,33 @@ void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* p
 	//if(params->ref_window_size > 1000) d_thr = 20;
 
 	// allocate temp storage for the seeds, initiate keys
+	uint64 n_contigs = 0;
+	for(uint32 i = 0; i < reads.reads.size(); i++) {
+		n_contigs += reads.reads[i].n_ref_matches;
+	}
+	reads.contig_kmer_ciphers.assign(n_contigs, NULL);
+	n_contigs = 0;
+	for(uint32 i = 0; i < reads.reads.size(); i++) {
+		read_t* r = &reads.reads[i];
+		r->contig_kmer_ciphers = reads.contig_kmer_ciphers.data() + n_contigs;
+		n_contigs += r->n_ref_matches;
+	}
+	// the cipher arrays are carved out of the per-thread arenas (released with the batch)
+	if(reads.cipher_arenas.size() < (uint32) omp_get_max_threads()) {
+		reads.cipher_arenas.resize(omp_get_max_threads());
+	}
 	#pragma omp parallel for
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
+		bump_arena_t& arena = reads.cipher_arenas[omp_get_thread_num()];
 		int n_proc_contigs = 0;
-		r->contig_kmer_ciphers.resize(r->ref_matches.size());
-		for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+		for(uint32 j = 0; j < r->n_ref_matches; j++) {
 			ref_match_t ref_contig = r->ref_matches[j];
 			if(r->n_proc_contigs > d_thr && ref_contig.n_diff_bucket_hits < 2) continue;
 			if(ref_contig.n_diff_bucket_hits < (int) (r->best_n_bucket_hits - params->dist_best_hit)) continue;
 			//if(ref_contig.n_diff_bucket_hits < params->min_n_hits) continue;
-			r->contig_kmer_ciphers[j] = new kmer_cipher_t[r->ref_matches[j].len - params->k2 + 1];//.resize(r->ref_matches[j].len - params->k2 + 1);
+			r->contig_kmer_ciphers[j] = arena.alloc<kmer_cipher_t>(r->ref_matches[j].len - params->k2 + 1);
 			n_proc_contigs++;
 		}
 		r->n_proc_contigs = n_proc_contigs;
@@ -1277,9 +1641,10 @@ void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* p
         for(uint32 i = 0; i < reads.reads.size(); i++) {
                 read_t* r = &reads.reads[i];
                 if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
-                r->kmers_f = new kmer_cipher_t[r->len - params->k2 + 1];
-                r->kmers_rc = new kmer_cipher_t[r->len - params->k2 + 1];
-                for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+                bump_arena_t& arena = reads.cipher_arenas[omp_get_thread_num()];
+                r->kmers_f = arena.alloc<kmer_cipher_t>(r->len - params->k2 + 1);
+                r->kmers_rc = arena.alloc<kmer_cipher_t>(r->len - params->k2 + 1);
+                for(uint32 j = 0; j < r->n_ref_matches; j++) {
                         if(r->contig_kmer_ciphers[j] == NULL) continue;
 			ref_match_t ref_contig = r->ref_matches[j];
                         if(r->ref_strand != 3) {
@@ -1292,18 +1657,22 @@ void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* p
         }
 
 	double t2 = omp_get_wtime();
-	#pragma omp parallel for
+	#pragma omp parallel
+	{
+	vote_scratch_t scratch;
+	#pragma omp for
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
-		if(r->ref_strand & 1) generate_voting_kmer_ciphers_read(r->kmers_f, r->seq.c_str(), r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
-		if(r->ref_strand & 2) generate_voting_kmer_ciphers_read(r->kmers_rc, r->rc.c_str(), r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
+		if(r->ref_strand & 1) generate_voting_kmer_ciphers_read(r->kmers_f, r->seq, r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params, scratch);
+		if(r->ref_strand & 2) generate_voting_kmer_ciphers_read(r->kmers_rc, r->rc, r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params, scratch);
 
-		for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+		for(uint32 j = 0; j < r->n_ref_matches; j++) {
 			if(r->contig_kmer_ciphers[j] == NULL) continue;			
 			generate_voting_kmer_ciphers_ref(r->contig_kmer_ciphers[j], ref.seq.c_str(), r->ref_matches[j].pos, r->ref_matches[j].len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
 		}
 	}
+	}
 	printf("Encryption time: %.2f sec\n", omp_get_wtime() - t2);
 	printf("Total client prep time: %.2f sec\n", omp_get_wtime() - start_time);
 	
@@ -1315,7 +1684,7 @@ void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* p
 		read_t* r = &reads.reads[i];
 		if(r->ref_strand & 1) total_size += (r->len - params->k2 + 1)*sizeof(kmer_cipher_t);
 		if(r->ref_strand & 2) total_size += (r->len - params->k2 + 1)*sizeof(kmer_cipher_t);
-		for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+		for(uint32 j = 0; j < r->n_ref_matches; j++) {
 			if(r->contig_kmer_ciphers[j] == NULL) continue;
 			int n_kmers = r->ref_matches[j].len - params->k2 + 1;
 			int n_sampled_kmers = (n_kmers-1)/params->sampling_intv + 1;
@@ -1329,19 +1698,24 @@ void phase2_encryption(reads_t& reads, const ref_t& ref, const index_params_t* p
 	printf("Total size: %.2f MB\n", ((float) total_size)/1024/1024);
 }
 
-void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* params, int* avg_score) {
+void phase2_voting(read_batch_t& reads, const ref_t& ref, const index_params_t* params, vote_stats_t* vote_stats) {
 	printf("////////////// Phase 2: Voting //////////////\n");
 	double start_time = omp_get_wtime();
 	omp_set_num_threads(params->n_threads);
 	int sum_score = 0;
 	int n_nonzero_scores = 0;
-	#pragma omp parallel for reduction(+:sum_score, n_nonzero_scores)
+	#pragma omp parallel reduction(+:sum_score, n_nonzero_scores)
+	{
+	vote_scratch_t scratch;
+	#pragma omp for
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
 
-		std::vector<std::pair<kmer_cipher_t, uint16_t>> read_kmers_f;
-		std::vector<std::pair<kmer_cipher_t, uint16_t>> read_kmers_rc;
+		std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmers_f = scratch.read_kmers_f;
+		std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmers_rc = scratch.read_kmers_rc;
+		read_kmers_f.clear();
+		read_kmers_rc.clear();
 		if(r->ref_strand & 1) read_kmers_f.resize(r->len - params->k2 + 1);
 		if(r->ref_strand & 2) read_kmers_rc.resize(r->len - params->k2 + 1);
 		
@@ -1352,13 +1726,14 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
 		if(r->ref_strand & 1) std::sort(read_kmers_f.begin(), read_kmers_f.end());
 		if(r->ref_strand & 2) std::sort(read_kmers_rc.begin(), read_kmers_rc.end());
 
-		for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+		for(uint32 j = 0; j < r->n_ref_matches; j++) {
 			ref_match_t ref_contig = r->ref_matches[j];
 			if(r->contig_kmer_ciphers[j] == NULL) continue;
-			std::vector<std::pair<kmer_cipher_t, uint16_t>>& read_kmer_ciphers = (ref_contig.rc) ? read_kmers_rc : read_kmers_f;
+			std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmer_ciphers = (ref_contig.rc) ? read_kmers_rc : read_kmers_f;
 			int n_kmers = ref_contig.len - params->k2 + 1;
 			int n_sampled_kmers = (n_kmers-1)/params->sampling_intv + 1;
-			std::vector<std::pair<kmer_cipher_t, uint16_t>> contig_kmer_ciphers(n_sampled_kmers);
+			std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& contig_kmer_ciphers = scratch.contig_kmers;
+			contig_kmer_ciphers.resize(n_sampled_kmers);
 			for(int c = 0; c < n_sampled_kmers; c++) {
                         	contig_kmer_ciphers[c] = std::make_pair((r->contig_kmer_ciphers[j])[c], params->sampling_intv*c);
                 	}
@@ -1367,7 +1742,7 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
 			int pos_sig[2] = { 0 };
 			seq_t pos[2] = { 0 };
 			int n_votes[2] = { 0 };
-			vote_cast_and_count(ref_contig, r->len, read_kmer_ciphers, contig_kmer_ciphers, params, n_votes, pos_sig);
+			vote_cast_and_count(ref_contig, r->len, read_kmer_ciphers, contig_kmer_ciphers, params, scratch, n_votes, pos_sig);
 
 			for(int i = 0; i < 2; i++) {
 				if(n_votes[i] == 0) continue;
@@ -1393,7 +1768,7 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
                         seq_t pos_tmp[2] = { 0 };
                         int n_votes_tmp[2] = { 0 };
 			std::cout << "SAMPLED \n";
-			vote_cast_and_count(ref_contig, r->len, read_kmer_ciphers, contig_kmer_ciphers, params, n_votes_tmp, pos_sig_tmp);
+			vote_cast_and_count(ref_contig, r->len, read_kmer_ciphers, contig_kmer_ciphers, params, scratch, n_votes_tmp, pos_sig_tmp);
 		
 			for(int i = 0; i < 2; i++) {
                                 if(n_votes_tmp[i] == 0) continue;
@@ -1415,7 +1790,7 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
 							int z = r->ref_pos_l;
 							while(true) {
 								if(z > r->ref_pos_r) break;
-								printf("%c", iupacChar[(int)ref.seq[z]]);
+								printf("%c", iupacChar[(int)ref.packed_seq.base(z)]);
 								z++;
 							}
 							printf("\n");
@@ -1459,10 +1834,10 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
 			n_nonzero_scores++;
 		}
 	}
-
-	if(n_nonzero_scores > 0) {
-		*avg_score = sum_score/n_nonzero_scores;
 	}
+
+	vote_stats->sum_score += sum_score;
+	vote_stats->n_nonzero_scores += n_nonzero_scores;
 	printf("Total time: %.2f sec\n", omp_get_wtime() - start_time);
 
 	// ---- determine the total communication size ----
@@ -1478,7 +1853,7 @@ void phase2_voting(reads_t& reads, const ref_t& ref, const index_params_t* param
 	printf("Total size: %.2f MB\n", ((float) total_size)/1024/1024);
 }
 
-void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* params, int* avg_score) {
+void phase2_monolith(read_batch_t& reads, const ref_t& ref, const index_params_t* params, vote_stats_t* vote_stats) {
 	printf("////////////// Phase 2: MONOLITH //////////////\n");
 	int d_thr = 800;
         if(params->ref_window_size > 150) d_thr = 500;
@@ -1488,34 +1863,44 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* par
         int sum_score = 0;
         int n_nonzero_scores = 0;
         double start_time = omp_get_wtime();
-        #pragma omp parallel for reduction(+:sum_score, n_nonzero_scores)
+        if(reads.cipher_arenas.size() < (uint32) omp_get_max_threads()) {
+                reads.cipher_arenas.resize(omp_get_max_threads());
+        }
+        #pragma omp parallel reduction(+:sum_score, n_nonzero_scores)
+        {
+        vote_scratch_t scratch;
+        bump_arena_t& arena = reads.cipher_arenas[omp_get_thread_num()];
+        #pragma omp for
         for(uint32 i = 0; i < reads.reads.size(); i++) {
                 read_t* r = &reads.reads[i];
                 if(!r->valid_minhash_f && !r->valid_minhash_rc) continue;
                 r->key1_xor_pad = genrand64_int64();
                 r->key2_mult_pad = genrand64_int64();
-                std::vector<std::pair<kmer_cipher_t, uint16_t>> read_kmers_f;
-                std::vector<std::pair<kmer_cipher_t, uint16_t>> read_kmers_rc;
+                std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmers_f = scratch.read_kmers_f;
+                std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmers_rc = scratch.read_kmers_rc;
+                read_kmers_f.clear();
+                read_kmers_rc.clear();
 
-                for(uint32 j = 0; j < r->ref_matches.size(); j++) {
+                for(uint32 j = 0; j < r->n_ref_matches; j++) {
                         if(r->n_proc_contigs > d_thr && r->ref_matches[j].n_diff_bucket_hits < 2) continue;
                         if(r->ref_matches[j].n_diff_bucket_hits < (int) (r->best_n_bucket_hits - params->dist_best_hit)) continue;
                         if(r->ref_matches[j].n_diff_bucket_hits < params->min_n_hits) continue;
 
                         const int n_kmers = r->ref_matches[j].len - params->k2 + 1;
-                        kmer_cipher_t* contig_ciphers = new kmer_cipher_t[n_kmers];
-                        generate_voting_kmer_ciphers_ref(contig_ciphers, ref.seq.c_str(), r->ref_matches[j].pos, r->ref_matches[j].len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
-                        std::vector<std::pair<kmer_cipher_t, uint16_t>> contig_kmer_ciphers(n_kmers);
+                        std::vector<kmer_cipher_t>& contig_ciphers = scratch.contig_ciphers;
+                        contig_ciphers.resize(n_kmers);
+                        generate_voting_kmer_ciphers_ref(contig_ciphers.data(), ref.seq.c_str(), r->ref_matches[j].pos, r->ref_matches[j].len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
+                        std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& contig_kmer_ciphers = scratch.contig_kmers;
+                        contig_kmer_ciphers.resize(n_kmers);
                         for(int c = 0; c < n_kmers; c++) {
                                 contig_kmer_ciphers[c] = std::make_pair(contig_ciphers[c], c);
                         }
-                        delete(contig_ciphers);
                         std::sort(contig_kmer_ciphers.begin(), contig_kmer_ciphers.end());
 
                         if((!r->ref_matches[j].rc) && (!(r->ref_strand & 1))) {
                                 r->ref_strand |= 1;
-                                r->kmers_f = new kmer_cipher_t[r->len - params->k2 + 1];
-                                generate_voting_kmer_ciphers_read(r->kmers_f, r->seq.c_str(), r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
+                                r->kmers_f = arena.alloc<kmer_cipher_t>(r->len - params->k2 + 1);
+                                generate_voting_kmer_ciphers_read(r->kmers_f, r->seq, r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params, scratch);
                                 read_kmers_f.resize(r->len - params->k2 + 1);
                                 for(int c = 0; c < r->len - params->k2 + 1; c++) {
                                         read_kmers_f[c] = std::make_pair(r->kmers_f[c], c);
@@ -1524,8 +1909,8 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* par
 
                         } else if((r->ref_matches[j].rc) && (!(r->ref_strand & 2))) {
                                 r->ref_strand |= 2;
-                                r->kmers_rc = new kmer_cipher_t[r->len - params->k2 + 1];
-                                generate_voting_kmer_ciphers_read(r->kmers_rc, r->rc.c_str(), r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params);
+                                r->kmers_rc = arena.alloc<kmer_cipher_t>(r->len - params->k2 + 1);
+                                generate_voting_kmer_ciphers_read(r->kmers_rc, r->rc, r->len, r->key1_xor_pad, r->key2_mult_pad, ref, params, scratch);
                                 read_kmers_rc.resize(r->len - params->k2 + 1);
                                 for(int c = 0; c < r->len - params->k2 + 1; c++) {
                                         read_kmers_rc[c] = std::make_pair(r->kmers_rc[c], c);
@@ -1533,11 +1918,11 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* par
                                 std::sort(read_kmers_rc.begin(), read_kmers_rc.end());
                         }
 
-                        std::vector<std::pair<kmer_cipher_t, uint16_t>>& read_kmer_ciphers = (r->ref_matches[j].rc) ? read_kmers_rc : read_kmers_f;
+                        std::vector<std::pair<kmer_cipher_t, pos_cipher_t>>& read_kmer_ciphers = (r->ref_matches[j].rc) ? read_kmers_rc : read_kmers_f;
                         int pos_sig[2] = { 0 };
                         seq_t pos[2] = { 0 };
                         int n_votes[2] = { 0 };
-                        vote_cast_and_count(r->ref_matches[j], r->len, read_kmer_ciphers, contig_kmer_ciphers, params, n_votes, pos_sig);
+                        vote_cast_and_count(r->ref_matches[j], r->len, read_kmer_ciphers, contig_kmer_ciphers, params, scratch, n_votes, pos_sig);
 
                         for(int i = 0; i < 2; i++) {
                                 if(n_votes[i] == 0) continue;
@@ -1571,25 +1956,18 @@ void phase2_monolith(reads_t& reads, const ref_t& ref, const index_params_t* par
 #endif
                 }
 
-                if(r->ref_strand & 1) {
-                        delete(r->kmers_f);
-                }
-                if(r->ref_strand & 2) {
-                        delete(r->kmers_rc);
-                }
-
                 if(r->top_aln.inlier_votes > 0) {
                         sum_score += r->top_aln.inlier_votes;
                         n_nonzero_scores++;
                 }
         }
-        if(n_nonzero_scores > 0) {
-                *avg_score = sum_score/n_nonzero_scores;
         }
+        vote_stats->sum_score += sum_score;
+        vote_stats->n_nonzero_scores += n_nonzero_scores;
         printf("Total time: %.2f sec\n", omp_get_wtime() - start_time);
 }
 
-void finalize(reads_t& reads, const uint32 avg_score, const ref_t& ref, const index_params_t* params) {
+void finalize(FILE* samFile, read_batch_t& reads, const uint32 avg_score, const ref_t& ref, const index_params_t* params) {
 	printf("////////////// Finalize Mappings //////////////\n");
 	double start_time = omp_get_wtime();
 	omp_set_num_threads(params->n_threads);
@@ -1615,11 +1993,11 @@ void finalize(reads_t& reads, const uint32 avg_score, const ref_t& ref, const in
 			}
 		}
 	}
-	store_alns_sam(reads, ref, params);
+	store_alns_sam(samFile, reads, ref, params);
 	printf("Total post-processing time: %.2f sec\n", omp_get_wtime() - start_time);
 }
 
-void eval(reads_t& reads, const ref_t& ref, const index_params_t* params) {
+void eval(read_batch_t& reads, const ref_t& ref, const index_params_t* params) {
 	printf("////////////// Evaluation //////////////\n");
 	// ---- debug -----
 	for(uint32 i = 0; i < reads.reads.size(); i++) {
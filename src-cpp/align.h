@@ -4,9 +4,9 @@
 #include "io.h"
 #include "index.h"
 
-void align_reads_lsh(ref_t& ref, reads_t& reads, const index_params_t* params);
-void align_reads_minhash(ref_t& ref, reads_t& reads, const index_params_t* params);
-void align_reads_sampling(ref_t& ref, reads_t& reads, const index_params_t* params);
-void balaur_main(const char* fastaName,ref_t& ref, reads_t& reads, const index_params_t* params);
+void align_reads_lsh(ref_t& ref, read_batch_t& reads, const index_params_t* params);
+void align_reads_minhash(ref_t& ref, read_batch_t& reads, const index_params_t* params);
+void align_reads_sampling(ref_t& ref, read_batch_t& reads, const index_params_t* params);
+void balaur_main(const char* fastaName, const char* readsFname, ref_t& ref, const index_params_t* params);
 
 #endif /*ALIGN_H_*/
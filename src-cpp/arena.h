@@ -0,0 +1,80 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include "types.h"
+
+#define BUMP_ARENA_CHUNK_SIZE (1ULL << 20)
+#define BUMP_ARENA_ALIGN 64
+
+// bump allocator: allocations are carved sequentially out of large chunks
+// and released all at once (the chunks are kept for reuse after a reset)
+// not thread-safe, each thread uses its own arena
+struct bump_arena_t {
+	std::vector<char*> chunks;
+	std::vector<uint64> chunk_sizes;
+	uint32 curr_chunk;				// chunk being carved
+	uint64 curr_pos;				// offset of the free space in the current chunk
+
+	bump_arena_t() : curr_chunk(0), curr_pos(0) {}
+
+	bump_arena_t(bump_arena_t&& other) : chunks(std::move(other.chunks)), chunk_sizes(std::move(other.chunk_sizes)),
+			curr_chunk(other.curr_chunk), curr_pos(other.curr_pos) {
+		other.chunks.clear();
+		other.chunk_sizes.clear();
+	}
+
+	~bump_arena_t() {
+		for(uint32 i = 0; i < chunks.size(); i++) {
+			free(chunks[i]);
+		}
+	}
+
+	// returns uninitialized storage for n elements (aligned to BUMP_ARENA_ALIGN)
+	template<typename T>
+	T* alloc(const uint64 n) {
+		const uint64 size = (n*sizeof(T) + BUMP_ARENA_ALIGN - 1) & ~((uint64) BUMP_ARENA_ALIGN - 1);
+		while(curr_chunk < chunks.size() && curr_pos + size > chunk_sizes[curr_chunk]) {
+			curr_chunk++;
+			curr_pos = 0;
+		}
+		if(curr_chunk == chunks.size()) {
+			const uint64 chunk_size = (size > BUMP_ARENA_CHUNK_SIZE) ? size : BUMP_ARENA_CHUNK_SIZE;
+			void* chunk;
+			if(posix_memalign(&chunk, BUMP_ARENA_ALIGN, chunk_size) != 0) {
+				printf("bump_arena: Could not allocate %llu bytes!\n", chunk_size);
+				exit(1);
+			}
+			chunks.push_back((char*) chunk);
+			chunk_sizes.push_back(chunk_size);
+			curr_pos = 0;
+		}
+		T* p = reinterpret_cast<T*>(chunks[curr_chunk] + curr_pos);
+		curr_pos += size;
+		return p;
+	}
+
+	// releases all the allocations
+	void reset() {
+		curr_chunk = 0;
+		curr_pos = 0;
+	}
+
+	uint64 size_bytes() const {
+		uint64 size = 0;
+		for(uint32 i = 0; i < chunk_sizes.size(); i++) {
+			size += chunk_sizes[i];
+		}
+		return size;
+	}
+
+private:
+	bump_arena_t(const bump_arena_t&);
+	bump_arena_t& operator=(const bump_arena_t&);
+};
+
+#endif /*ARENA_H_*/
@@ -20,10 +20,10 @@ typedef struct {
 typedef std::vector<cluster_t> VectorClusters;
 
 void sort_windows_hash(ref_t& ref);
-void sort_reads_hash(reads_t& reads);
+void sort_reads_hash(read_batch_t& reads);
 seq_t get_num_distinct(ref_t& ref);
-void cluster_sorted_reads(reads_t& reads, VectorClusters& out);
-void cluster_reads(reads_t& reads, VectorClusters& out);
+void cluster_sorted_reads(read_batch_t& reads, VectorClusters& out);
+void cluster_reads(read_batch_t& reads, VectorClusters& out);
 
 int collapse_clusters(VectorClusters& clusters, index_params_t& params);
 
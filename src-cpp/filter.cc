@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include "filter.h"
+
+const char* freq_filter_type_name(const freq_filter_type type) {
+	switch(type) {
+	case FREQ_FILTER_SORTED: return "sorted array";
+	case FREQ_FILTER_BLOOM: return "blocked Bloom filter";
+	case FREQ_FILTER_BITMAP: return "bitmap";
+	default: return "auto";
+	}
+}
+
+// builds the filter over the given frequent kmers
+// (the type is selected based on the number of distinct kmers unless requested explicitly)
+void freq_kmer_filter_t::build(std::vector<uint32>& freq_kmers, const freq_filter_type requested_type) {
+	std::sort(freq_kmers.begin(), freq_kmers.end());
+	freq_kmers.erase(std::unique(freq_kmers.begin(), freq_kmers.end()), freq_kmers.end());
+	n_kmers = freq_kmers.size();
+
+	type = requested_type;
+	if(type == FREQ_FILTER_AUTO) {
+		if(n_kmers <= FREQ_FILTER_SORTED_MAX_KMERS) {
+			type = FREQ_FILTER_SORTED;
+		} else if(n_kmers <= FREQ_FILTER_BLOOM_MAX_KMERS) {
+			type = FREQ_FILTER_BLOOM;
+		} else {
+			type = FREQ_FILTER_BITMAP;
+		}
+	}
+
+	kmers.clear();
+	dir.clear();
+	words.clear();
+	n_blocks_mask = 0;
+	switch(type) {
+	case FREQ_FILTER_SORTED: {
+		kmers.swap(freq_kmers);
+		dir.resize((1ULL << FREQ_FILTER_DIR_BITS) + 1);
+		uint32 i = 0;
+		for(uint32 prefix = 0; prefix < (1U << FREQ_FILTER_DIR_BITS); prefix++) {
+			dir[prefix] = i;
+			while(i < kmers.size() && (kmers[i] >> (32 - FREQ_FILTER_DIR_BITS)) == prefix) {
+				i++;
+			}
+		}
+		dir[1ULL << FREQ_FILTER_DIR_BITS] = i;
+		break;
+	}
+	case FREQ_FILTER_BLOOM: {
+		uint64 n_blocks = 1;
+		while(n_blocks*FREQ_FILTER_BLOOM_BLOCK_WORDS*64 < n_kmers*FREQ_FILTER_BLOOM_BITS_PER_KMER) {
+			n_blocks <<= 1;
+		}
+		n_blocks_mask = n_blocks - 1;
+		words.resize(n_blocks*FREQ_FILTER_BLOOM_BLOCK_WORDS);
+		for(uint64 i = 0; i < n_kmers; i++) {
+			const uint64 h = bloom_hash(freq_kmers[i]);
+			uint64* block = &words[((h >> 32) & n_blocks_mask)*FREQ_FILTER_BLOOM_BLOCK_WORDS];
+			for(uint32 j = 0; j < FREQ_FILTER_BLOOM_BLOCK_WORDS; j++) {
+				block[j] |= 1ULL << ((((uint32) h)*freq_filter_bloom_salts[j]) >> 26);
+			}
+		}
+		break;
+	}
+	default:
+		words.resize(FREQ_FILTER_BITMAP_WORDS);
+		for(uint64 i = 0; i < n_kmers; i++) {
+			words[freq_kmers[i] >> 6] |= 1ULL << (freq_kmers[i] & 63);
+		}
+		break;
+	}
+}
+
+uint64 freq_kmer_filter_t::size_bytes() const {
+	return kmers.size()*sizeof(uint32) + dir.size()*sizeof(uint32) + words.size()*sizeof(uint64);
+}
+
+void freq_kmer_filter_t::store(const std::string& fname, const uint64 max_count, const struct stat& hist_st) const {
+	std::ofstream file;
+	file.open(fname.c_str(), std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		printf("store_freq_kmer_filter: Cannot open the filter file %s!\n", fname.c_str());
+		exit(1);
+	}
+	freq_filter_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = FREQ_FILTER_MAGIC;
+	header.type = type;
+	header.max_count = max_count;
+	header.hist_size = hist_st.st_size;
+	header.hist_mtime_sec = hist_st.st_mtim.tv_sec;
+	header.hist_mtime_nsec = hist_st.st_mtim.tv_nsec;
+	header.n_kmers = n_kmers;
+	header.n_dir = dir.size();
+	header.n_words = words.size();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(kmers.data()), kmers.size()*sizeof(uint32));
+	file.write(reinterpret_cast<const char*>(dir.data()), dir.size()*sizeof(uint32));
+	file.write(reinterpret_cast<const char*>(words.data()), words.size()*sizeof(uint64));
+	file.close();
+}
+
+// returns false if the file does not exist or was built from a different histogram, threshold or filter type
+bool freq_kmer_filter_t::load(const std::string& fname, const uint64 max_count, const struct stat& hist_st, const freq_filter_type requested_type) {
+	std::ifstream file;
+	file.open(fname.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	freq_filter_header_t header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || header.magic != FREQ_FILTER_MAGIC || header.max_count != max_count || header.hist_size != (uint64) hist_st.st_size ||
+			header.hist_mtime_sec != (uint64) hist_st.st_mtim.tv_sec || header.hist_mtime_nsec != (uint64) hist_st.st_mtim.tv_nsec ||
+			(requested_type != FREQ_FILTER_AUTO && header.type != (uint32) requested_type)) {
+		file.close();
+		return false;
+	}
+	type = (freq_filter_type) header.type;
+	n_kmers = header.n_kmers;
+	kmers.resize(type == FREQ_FILTER_SORTED ? n_kmers : 0);
+	dir.resize(header.n_dir);
+	words.resize(header.n_words);
+	n_blocks_mask = type == FREQ_FILTER_BLOOM ? header.n_words/FREQ_FILTER_BLOOM_BLOCK_WORDS - 1 : 0;
+	file.read(reinterpret_cast<char*>(kmers.data()), kmers.size()*sizeof(uint32));
+	file.read(reinterpret_cast<char*>(dir.data()), dir.size()*sizeof(uint32));
+	file.read(reinterpret_cast<char*>(words.data()), words.size()*sizeof(uint64));
+	if(!file) {
+		printf("load_freq_kmer_filter: Filter file %s is truncated!\n", fname.c_str());
+		exit(1);
+	}
+	file.close();
+	return true;
+}
@@ -0,0 +1,122 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#pragma once
+
+#include <smmintrin.h>
+#include <sys/stat.h>
+#include "types.h"
+
+// high-frequency kmer filters
+// the frequent kmers (packed as in pack_32) are stored in one of:
+// - a sorted array with a directory over the 16-bit kmer prefixes (exact, small sets)
+// - a cache-blocked Bloom filter: one 512-bit block per kmer, 8 bits set per kmer (approximate, medium sets)
+// - a dense bitmap over all 2^32 kmers (exact, 512MB)
+typedef enum {FREQ_FILTER_AUTO = 0, FREQ_FILTER_SORTED = 1, FREQ_FILTER_BLOOM = 2, FREQ_FILTER_BITMAP = 3} freq_filter_type;
+
+#define FREQ_FILTER_SORTED_MAX_KMERS (1ULL << 22)	// auto selection: sorted array up to 16MB
+#define FREQ_FILTER_BLOOM_MAX_KMERS (1ULL << 25)	// auto selection: Bloom filter up to 64MB, bitmap above
+#define FREQ_FILTER_DIR_BITS 16						// sorted array directory: kmer prefix length in bits
+#define FREQ_FILTER_SCAN_LEN 16						// sorted array: runs up to this length are scanned with SIMD
+#define FREQ_FILTER_BLOOM_BITS_PER_KMER 16
+#define FREQ_FILTER_BLOOM_BLOCK_WORDS 8				// 512-bit blocks (one cache line)
+#define FREQ_FILTER_BITMAP_WORDS (1ULL << 26)		// 2^32 bits
+
+#define FREQ_FILTER_MAGIC 0x32304b464b524c42ULL // "BLRKFK02"
+
+typedef struct {
+	uint64 magic;
+	uint32 type;
+	uint32 reserved;
+	uint64 max_count;				// kmer occurrence threshold used to select the kmers
+	uint64 hist_size;				// size and modification time of the kmer histogram file the filter was built from
+	uint64 hist_mtime_sec;
+	uint64 hist_mtime_nsec;
+	uint64 n_kmers;					// number of frequent kmers
+	uint64 n_dir;					// number of directory entries (sorted array)
+	uint64 n_words;					// number of 64-bit words (Bloom filter, bitmap)
+} freq_filter_header_t;
+
+static const uint32 freq_filter_bloom_salts[FREQ_FILTER_BLOOM_BLOCK_WORDS] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+struct freq_kmer_filter_t {
+	freq_filter_type type;
+	uint64 n_kmers;
+	std::vector<uint32> kmers;		// sorted array: the sorted frequent kmers
+	std::vector<uint32> dir;		// sorted array: offset of the first kmer of each prefix (+ the total)
+	std::vector<uint64> words;		// Bloom filter blocks or bitmap words
+	uint64 n_blocks_mask;			// Bloom filter: number of blocks - 1 (power of 2)
+
+	freq_kmer_filter_t() : type(FREQ_FILTER_BITMAP), n_kmers(0), n_blocks_mask(0) {}
+
+	inline bool contains(const uint32 kmer) const {
+		switch(type) {
+		case FREQ_FILTER_SORTED:
+			return contains_sorted(kmer);
+		case FREQ_FILTER_BLOOM:
+			return contains_bloom(kmer);
+		default:
+			return (words[kmer >> 6] >> (kmer & 63)) & 1;
+		}
+	}
+
+	inline bool contains_sorted(const uint32 kmer) const {
+		const uint32 prefix = kmer >> (32 - FREQ_FILTER_DIR_BITS);
+		uint32 start = dir[prefix];
+		uint32 end = dir[prefix + 1];
+		while(end - start > FREQ_FILTER_SCAN_LEN) { // narrow down long runs
+			const uint32 mid = start + (end - start)/2;
+			if(kmers[mid] < kmer) {
+				start = mid + 1;
+			} else {
+				end = mid + 1;
+			}
+		}
+		const __m128i key = _mm_set1_epi32(kmer);
+		uint32 i = start;
+		for(; i + 4 <= end; i += 4) {
+			const __m128i v = _mm_loadu_si128((const __m128i*) &kmers[i]);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi32(v, key))) {
+				return true;
+			}
+		}
+		for(; i < end; i++) {
+			if(kmers[i] == kmer) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// murmur3 64-bit finalizer: the high bits select the block, the low bits the bit in each block word
+	static inline uint64 bloom_hash(const uint32 kmer) {
+		uint64 h = kmer;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	inline bool contains_bloom(const uint32 kmer) const {
+		const uint64 h = bloom_hash(kmer);
+		const uint64* block = &words[((h >> 32) & n_blocks_mask)*FREQ_FILTER_BLOOM_BLOCK_WORDS];
+		bool found = true;
+		for(uint32 i = 0; i < FREQ_FILTER_BLOOM_BLOCK_WORDS; i++) {
+			found &= (block[i] >> ((((uint32) h)*freq_filter_bloom_salts[i]) >> 26)) & 1;
+		}
+		return found;
+	}
+
+	void build(std::vector<uint32>& freq_kmers, const freq_filter_type requested_type);
+	uint64 size_bytes() const;
+	void store(const std::string& fname, const uint64 max_count, const struct stat& hist_st) const;
+	bool load(const std::string& fname, const uint64 max_count, const struct stat& hist_st, const freq_filter_type requested_type);
+};
+
+const char* freq_filter_type_name(const freq_filter_type type);
+
+#endif /*FILTER_H_*/
@@ -43,7 +43,7 @@ struct rand_hash_function_t {
 		return (minhash_t) a*x >> (w - M);
 	}
 
-	minhash_t apply_vector(const VectorMinHash& x, const VectorU32& indices, const uint32 vec_offset) const {
+	minhash_t apply_vector(const minhash_t* x, const VectorU32& indices, const uint32 vec_offset) const {
 		uint64 s = 0;
 		for(uint32 i = 0; i < a_vec.size(); i++) {
 			s += a_vec[i]*x[indices[vec_offset + i]];
@@ -77,6 +77,16 @@ struct kmer_hasher_t {
 	minhash_t encrypt_base_seq(const char* seq, const seq_t seq_len) const {
 		return CityHash32(seq, seq_len);
 	}
+
+	// integer hash of the packed kmer (murmur3 finalizer, a bijection on 32 bits)
+	minhash_t encrypt_packed_kmer(uint32 packed_kmer) const {
+		packed_kmer ^= packed_kmer >> 16;
+		packed_kmer *= 0x85ebca6b;
+		packed_kmer ^= packed_kmer >> 13;
+		packed_kmer *= 0xc2b2ae35;
+		packed_kmer ^= packed_kmer >> 16;
+		return packed_kmer;
+	}
 };
 
 inline int irand(int n) {
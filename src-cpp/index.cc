@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <time.h>
 #include <limits.h>
+#include <unistd.h>
 #include <omp.h>
 #include "types.h"
 #include "index.h"
@@ -12,6 +13,7 @@
 #include "io.h"
 #include "hash.h"
 #include <fstream>
+#include <string.h>
 
 // --- Minhash ---
 
@@ -22,19 +24,124 @@
 // - bucket into multiple hash tables using different projections
 // - sort buckets
 
-#define REPORT_WINDOW_PROC_GRANULARITY 2000000
+// the windows are hashed in fixed-size chunks that are scheduled dynamically across the threads
+// (the chunk boundaries do not depend on the number of threads, so neither does the index)
+#define INDEX_CHUNK_N_WINDOWS (1 << 18)
+
+struct window_stats_t {
+	uint32 n_valid_windows;
+	uint32 n_valid_hashes;
+	uint64 n_bucket_entries;
+	uint64 n_filtered;
+	window_stats_t() : n_valid_windows(0), n_valid_hashes(0), n_bucket_entries(0), n_filtered(0) {}
+};
+
+// hashes the reference windows in [chunk_start, chunk_end) and emits one entry per table for each valid window
+// - consecutive windows that fall into the same bucket are merged into a single entry
+// - if buckets_data is NULL the entries are only counted in the shared bucket_counts, incremented atomically (counting pass)
+// - otherwise each entry is written at the next free slot of its bucket, claimed atomically from bucket_cursors
+void index_ref_windows(const ref_t& ref, const index_params_t* params,
+		const seq_t chunk_start, const seq_t chunk_end,
+		minhash_matrix_t& rolling_minhash_matrix, VectorMinHash& minhashes,
+		uint64* bucket_counts, uint64* bucket_cursors, loc_t* buckets_data, window_stats_t& stats) {
+
+	// last entry emitted into each table, used to extend contiguous window runs
+	std::vector<loc_t> last_loc(params->n_tables);
+	std::vector<uint64> last_bid(params->n_tables, UINT64_MAX);
+	std::vector<uint64> last_idx(params->n_tables);
+
+	bool init_minhash = true;
+	for (seq_t pos = chunk_start; pos != chunk_end; pos++) { // for each window of the chunk
+		// discard windows with low information content
+		if(ref.ignore_window_bitmask[pos]) {
+			init_minhash = true;
+			continue;
+		}
+		stats.n_valid_windows++;
+
+		// get the min-hash signature for the window
+		bool valid_hash;
+		if(init_minhash == true) {
+			if(params->alg == OPH) {
+				valid_hash = oph_rolling_init(ref.seq.c_str(), pos, params->ref_window_size,
+						rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
+						minhashes);
+			} else {
+				valid_hash = minhash_rolling_init(ref.seq.c_str(), pos, params->ref_window_size,
+						rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
+						minhashes);
+			}
+			init_minhash = false;
+		} else {
+			if(params->alg == OPH) {
+				valid_hash = oph_rolling(ref.seq.c_str(), pos, params->ref_window_size,
+						rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
+						minhashes);
+			} else {
+				valid_hash = minhash_rolling(ref.seq.c_str(), pos, params->ref_window_size,
+						rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
+						minhashes);
+			}
+		}
+
+		if(!valid_hash) {
+			continue;
+		}
+		stats.n_valid_hashes++;
+
+		for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
+			minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(
+					minhashes.data(), params->sketch_proj_indices, t*params->sketch_proj_len);
+			uint64 bid = (uint64) t*params->n_buckets + params->sketch_proj_hash_func.bucket_hash(proj_hash);
+
+			// extend the last entry if the previous window landed in the same bucket
+			loc_t* epos = &last_loc[t];
+			if(last_bid[t] == bid && epos->len < MAX_LOC_LEN && (epos->pos + epos->len) == pos) {
+				epos->len++;
+				if(buckets_data != NULL) {
+					buckets_data[last_idx[t]].len++;
+				}
+				stats.n_filtered++;
+				continue;
+			}
+			epos->pos = pos;
+			epos->len = 1;
+			epos->hash = proj_hash;
+			last_bid[t] = bid;
+			if(buckets_data == NULL) {
+				#pragma omp atomic
+				bucket_counts[bid]++;
+			} else {
+				uint64 idx;
+				#pragma omp atomic capture
+				idx = bucket_cursors[bid]++;
+				last_idx[t] = idx;
+				buckets_data[idx] = *epos;
+			}
+			stats.n_bucket_entries++;
+		}
+	}
+}
 
 void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 	// 1. load the reference
 	printf("Loading FASTA file %s... \n", fastaFname);
 	clock_t t = clock();
 	fasta2ref(fastaFname, ref);
+	store_ref_bin(fastaFname, ref);
 	printf("Reference loading time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
 	// 2. load the frequency of each kmer and collect high-frequency kmers
-	printf("Loading frequent kmers... \n");
+	// (the kmer histogram and the filter are computed if the histogram is missing)
 	double start_time = omp_get_wtime();
-	load_freq_kmers(fastaFname, ref.high_freq_kmer_bitmap, ref.high_freq_kmer_trie, params->max_count);
+	std::string hist_fname(fastaFname);
+	hist_fname += std::string(".kmer_hist");
+	if(access(hist_fname.c_str(), F_OK) != 0) {
+		printf("Counting reference kmers... \n");
+		compute_store_kmer_hist(fastaFname, ref, params);
+	}
+	printf("Loading frequent kmers... \n");
+	load_freq_kmers(fastaFname, ref.high_freq_kmer_filter, ref.high_freq_kmer_trie, params);
 	mark_freq_kmers(ref, params);
 
 	printf("Loading valid windows mask... \n");
@@ -44,22 +151,8 @@ void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 	}
 	printf("Total window/kmer pre-processing time: %.2f sec\n", omp_get_wtime() - start_time);
 
-	// initialize the hash tables
-	ref.mutable_index.per_table_buckets.resize(params->n_tables);
-	for(uint32 t = 0; t < params->n_tables; t++) {
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-		// initialize global buckets
-		buckets->buckets_data_vectors.resize(params->n_buckets);
-		// initialize per thread buckets
-		buckets->per_thread_buckets_data_vectors.resize(params->n_threads);
-		buckets->per_thread_bucket_sizes.resize(params->n_threads);
-		for(uint32 tid = 0; tid < params->n_threads; tid++) {
-			buckets->per_thread_buckets_data_vectors[tid].resize(params->n_buckets);
-			buckets->per_thread_bucket_sizes[tid].resize(params->n_buckets, 0);
-		}
-	}
-
-	// initialize additional per-thread storage
+	// initialize per-thread storage
+	const uint64 n_total_buckets = (uint64) params->n_tables*params->n_buckets;
 	std::vector<minhash_matrix_t> minhash_matrices(params->n_threads);
 	std::vector<VectorMinHash> minhash_thread_vectors(params->n_threads);
 	for(uint32 i = 0; i < params->n_threads; i++) {
@@ -67,177 +160,366 @@ void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref) {
 		std::fill(minhash_thread_vectors[i].begin(), minhash_thread_vectors[i].end(), UINT_MAX);
 	}
 
-	// 3. hash each valid window
+	// the index is built in two passes over the windows directly into the flat (CSR) layout:
+	// the first pass counts the entries in each bucket,
+	// the second pass recomputes the window fingerprints and scatters the entries
+	// 3. count the bucket entries
 	printf("Hashing reference windows... \n");
 	uint32 n_valid_windows = 0;
 	uint32 n_valid_hashes = 0;
 	uint64 n_bucket_entries = 0;
 	uint64 n_filtered = 0;
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	const uint64 n_chunks = (n_windows + INDEX_CHUNK_N_WINDOWS - 1) / INDEX_CHUNK_N_WINDOWS;
+	// per-thread windows and time of each pass (0 - counting, 1 - scatter)
+	std::vector<uint64> thread_n_windows[2] = { std::vector<uint64>(params->n_threads, 0), std::vector<uint64>(params->n_threads, 0) };
+	std::vector<double> thread_time[2] = { std::vector<double>(params->n_threads, 0), std::vector<double>(params->n_threads, 0) };
 
-#if EXTERNAL_MEM_INDEX
-#define MAX_NTABLES_NO_DISK 1024
-	int file_nsync_points = 0;
-	if(params->n_tables > MAX_NTABLES_NO_DISK) {
-		file_nsync_points = 42*params->n_tables/128;
-	}
-	VectorU32 nsync_per_thread(params->n_threads);
-#endif
-
+	// the entries are counted directly into the bucket offsets array (shared by all the threads)
 	start_time = omp_get_wtime();
-	omp_set_num_threads(params->n_threads); // split the windows across the threads
+	ref.index.bucket_offsets_buf.assign(n_total_buckets + 1, 0);
+	uint64* bucket_counts = &ref.index.bucket_offsets_buf[0];
+	omp_set_num_threads(params->n_threads);
 	#pragma omp parallel reduction(+:n_valid_windows, n_valid_hashes, n_bucket_entries, n_filtered)
 	{
-	    int tid = omp_get_thread_num();
-	    int n_threads = omp_get_num_threads();
-	    seq_t chunk_start = ((ref.len - params->ref_window_size + 1) / n_threads)*tid;
-	    seq_t chunk_end = ((ref.len - params->ref_window_size + 1) / n_threads)*(tid + 1);
-	    printf("Thread %d range: %u %u \n", tid, chunk_start, chunk_end);
-
-#if EXTERNAL_MEM_INDEX
-	    int sync_point = 1;
-#endif
-	    bool init_minhash = true;
-	    for (seq_t pos = chunk_start; pos != chunk_end; pos++) { // for each window of the thread's chunk
-	    	if((pos - chunk_start) % REPORT_WINDOW_PROC_GRANULARITY == 0 && (pos - chunk_start) != 0) {
-				printf("Thread %d processed %u valid windows \n", tid, pos - chunk_start);
-			}
-#if EXTERNAL_MEM_INDEX
-	    	// check if we should write to file
-	    	if(file_nsync_points > 0) {
-	    		int sync_chunk_size = (chunk_end - chunk_start + 1)/(file_nsync_points + 1);
-	    		if(n_valid_windows == (uint32)sync_chunk_size*sync_point) {
-	    			printf("Thread %d sync point: %u, n_valid_windows: %u \n", tid, pos, n_valid_windows);
-	    			store_ref_idx_per_thread(tid, sync_point == 1, fastaFname, ref, params);
-	    			sync_point++;
-	    			nsync_per_thread[tid]++;
-	    		}
-	    	}
-#endif
-	    	// discard windows with low information content
-	    	if(ref.ignore_window_bitmask[pos]) {
-	    		init_minhash = true;
-	    		continue;
-			}
-	    	n_valid_windows++;
-
-	    	// get the min-hash signature for the window
-	    	VectorMinHash& minhashes = minhash_thread_vectors[tid]; // each thread indexes into its pre-allocated buffer
-	    	minhash_matrix_t& rolling_minhash_matrix = minhash_matrices[tid];
-	    	bool valid_hash;
-	    	if(init_minhash == true) {
-	    		valid_hash = minhash_rolling_init(ref.seq.c_str(), pos, params->ref_window_size,
-	    					rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
-							minhashes);
-	    		init_minhash = false;
-	    	} else {
-	    		valid_hash = minhash_rolling(ref.seq.c_str(), pos, params->ref_window_size,
-	    					rolling_minhash_matrix, ref.ignore_kmer_bitmask, params,
-							minhashes);
-	    	}
-
-	    	if(!valid_hash) {
-	    		continue;
-	    	}
-	    	n_valid_hashes++;
-
-	    	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-	    		minhash_t proj_hash = params->sketch_proj_hash_func.apply_vector(
-	    				minhashes, params->sketch_proj_indices, t*params->sketch_proj_len);
-	    		minhash_t bucket_hash = params->sketch_proj_hash_func.bucket_hash(proj_hash);
-	    		
-			buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-	    		VectorSeqPos& bucket = buckets->per_thread_buckets_data_vectors[tid][bucket_hash];
-	    		if(bucket.size() == 0) { // first item in this thread bucket
-	    			bucket.resize(params->bucket_size);
-	    		}
-	    		// add to the bucket
-	    		uint32 curr_size = buckets->per_thread_bucket_sizes[tid][bucket_hash];
-	    		if(curr_size + 1 >= bucket.size()) {
-	    			bucket.resize(curr_size + 100);
-	    		}
-				bool store_pos = true;
-				if(curr_size > 0) {
-					loc_t* epos = &bucket[curr_size-1];
-					if(epos->len < MAX_LOC_LEN && (epos->pos + epos->len) == pos) {
-						epos->len++;
-						store_pos = false;
-					} /*else if((epos->pos + epos->len) + params->bucket_entry_coverage >= pos) { // sampling
-						epos->len += pos - (epos->pos + epos->len - 1);
-						store_pos = false;
-					}*/
-				}
-				if(store_pos) {
-					loc_t new_loc;
-					new_loc.pos = pos;
-					new_loc.len = 1;
-					new_loc.hash = proj_hash;
-					bucket[curr_size] = new_loc;
-					buckets->per_thread_bucket_sizes[tid][bucket_hash]++;
-					n_bucket_entries++;
-				} else {
-					n_filtered++;
-				}
-	    	}
-	    }
+		int tid = omp_get_thread_num();
+		double thread_start_time = omp_get_wtime();
+		window_stats_t thread_stats;
+		#pragma omp for schedule(dynamic, 1) nowait
+		for(uint64 c = 0; c < n_chunks; c++) {
+			const seq_t chunk_start = c*INDEX_CHUNK_N_WINDOWS;
+			const seq_t chunk_end = std::min((uint64) n_windows, (c+1)*INDEX_CHUNK_N_WINDOWS);
+			index_ref_windows(ref, params, chunk_start, chunk_end, minhash_matrices[tid], minhash_thread_vectors[tid],
+					bucket_counts, NULL, NULL, thread_stats);
+			thread_n_windows[0][tid] += chunk_end - chunk_start;
+		}
+		thread_time[0][tid] += omp_get_wtime() - thread_start_time;
+		n_valid_windows += thread_stats.n_valid_windows;
+		n_valid_hashes += thread_stats.n_valid_hashes;
+		n_bucket_entries += thread_stats.n_bucket_entries;
+		n_filtered += thread_stats.n_filtered;
 	}
-	printf("Populated all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_time);
+	printf("Counted all the bucket entries. Time : %.2f sec\n", omp_get_wtime() - start_time);
 
-	// 4. collect per thread results
-	printf("Collecting thread buckets... \n");
-	double start_coll_sort = omp_get_wtime();
+	// 4. prefix-sum the counts into the bucket offsets (in place)
+	double start_time_offsets = omp_get_wtime();
+	std::vector<uint64> table_sizes(params->n_tables + 1, 0);
+	#pragma omp parallel for
 	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-		buckets->n_entries = 0;
-		for(uint32 b = 0; b < params->n_buckets; b++) {
-			for(uint32 tid = 0; tid < params->n_threads; tid++) {
-				VectorSeqPos& global_bucket = buckets->buckets_data_vectors[b];
-				VectorSeqPos& thread_bucket = buckets->per_thread_buckets_data_vectors[tid][b];
-				global_bucket.insert(global_bucket.end(), thread_bucket.begin(), thread_bucket.begin() + buckets->per_thread_bucket_sizes[tid][b]);
-				VectorSeqPos().swap(buckets->per_thread_buckets_data_vectors[tid][b]);
-				buckets->n_entries += buckets->per_thread_bucket_sizes[tid][b];
-			}
+		uint64 table_size = 0;
+		for(uint64 bid = (uint64) t*params->n_buckets; bid < (uint64) (t+1)*params->n_buckets; bid++) {
+			const uint64 count = ref.index.bucket_offsets_buf[bid];
+			ref.index.bucket_offsets_buf[bid] = table_size;
+			table_size += count;
+		}
+		table_sizes[t+1] = table_size;
+	}
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		table_sizes[t+1] += table_sizes[t];
+	}
+	#pragma omp parallel for
+	for(uint32 t = 0; t < params->n_tables; t++) {
+		for(uint64 bid = (uint64) t*params->n_buckets; bid < (uint64) (t+1)*params->n_buckets; bid++) {
+			ref.index.bucket_offsets_buf[bid] += table_sizes[t];
 		}
-		std::vector<VectorU32>().swap(buckets->per_thread_bucket_sizes);
-		std::vector<std::vector<VectorSeqPos>>().swap(buckets->per_thread_buckets_data_vectors);
 	}
-	printf("Collected all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_coll_sort);
+	ref.index.bucket_offsets_buf[n_total_buckets] = table_sizes[params->n_tables];
+	ref.index.buckets_data_buf.resize(table_sizes[params->n_tables]);
+	std::vector<uint64> bucket_cursors(ref.index.bucket_offsets_buf.begin(), ref.index.bucket_offsets_buf.end() - 1);
+	printf("Computed the bucket offsets. Time : %.2f sec\n", omp_get_wtime() - start_time_offsets);
 
-#if EXTERNAL_MEM_INDEX
-	if(file_nsync_points > 0) { // read partial files from disk
-		for(uint32 tid = 0; tid < params->n_threads; tid++) {
-			load_ref_idx_per_thread(tid, nsync_per_thread[tid], fastaFname, ref, params);
+	// 5. populate the buckets
+	double start_time_scatter = omp_get_wtime();
+	#pragma omp parallel
+	{
+		int tid = omp_get_thread_num();
+		double thread_start_time = omp_get_wtime();
+		window_stats_t thread_stats;
+		#pragma omp for schedule(dynamic, 1) nowait
+		for(uint64 c = 0; c < n_chunks; c++) {
+			const seq_t chunk_start = c*INDEX_CHUNK_N_WINDOWS;
+			const seq_t chunk_end = std::min((uint64) n_windows, (c+1)*INDEX_CHUNK_N_WINDOWS);
+			index_ref_windows(ref, params, chunk_start, chunk_end, minhash_matrices[tid], minhash_thread_vectors[tid],
+					NULL, &bucket_cursors[0], &ref.index.buckets_data_buf[0], thread_stats);
+			thread_n_windows[1][tid] += chunk_end - chunk_start;
 		}
+		thread_time[1][tid] += omp_get_wtime() - thread_start_time;
 	}
-#endif
+	std::vector<uint64>().swap(bucket_cursors);
+	ref.index.attach_buffers();
+	printf("Populated all the buckets. Time : %.2f sec\n", omp_get_wtime() - start_time_scatter);
 
-	// 5. sort each bucket!
+	// 6. sort each bucket!
 	printf("Sorting buckets... \n");
 	double start_time_sort = omp_get_wtime();
-	#pragma omp parallel for
-	for(uint32 t = 0; t < params->n_tables; t++) { // for each hash table
-		buckets_t* buckets = &ref.mutable_index.per_table_buckets[t];
-		for(uint32 b = 0; b < params->n_buckets; b++) {
-			VectorSeqPos& bucket = buckets->buckets_data_vectors[b];
-			std::sort(bucket.begin(), bucket.end(), comp_loc());
-		}
-	}
+	sort_index_buckets(ref.index, params);
 	printf("Total sort time : %.2f sec\n", omp_get_wtime() - start_time_sort);
+	if(params->hash_dir && params->layout == IDX_LAYOUT_FLAT) {
+		double start_time_dir = omp_get_wtime();
+		build_index_hash_directory(ref.index, params);
+		printf("Built the bucket hash directory: %llu distinct hashes. Time : %.2f sec\n", ref.index.n_dir_entries, omp_get_wtime() - start_time_dir);
+	}
+	if(params->layout == IDX_LAYOUT_SOA) {
+		split_index_columns(ref.index, params);
+	}
+	if(params->layout == IDX_LAYOUT_PACKED) {
+		double start_time_pack = omp_get_wtime();
+		const uint64 n_flat_bytes = ref.index.n_entries*sizeof(loc_t);
+		pack_index_buckets(ref.index, params);
+		printf("Packed the buckets: %llu -> %llu bytes (%.2fx). Time : %.2f sec\n", n_flat_bytes, ref.index.n_packed_bytes,
+				(double) n_flat_bytes / std::max(ref.index.n_packed_bytes, 1ULL), omp_get_wtime() - start_time_pack);
+	}
 	printf("Total number of valid reference windows: %u \n", n_valid_windows);
 	printf("Total number of valid reference windows with valid hashes: %u \n", n_valid_hashes);
 	printf("Total number of window bucket entries: %llu \n", n_bucket_entries);
 	printf("Total number of window bucket entries filtered: %llu \n", n_filtered);
+	for(uint32 tid = 0; tid < params->n_threads; tid++) {
+		for(uint32 pass = 0; pass < 2; pass++) {
+			printf("Thread %u: %s pass hashed %llu windows in %.2f sec (%.2f M windows/sec) \n", tid, pass == 0 ? "counting" : "scatter",
+					thread_n_windows[pass][tid], thread_time[pass][tid],
+					thread_time[pass][tid] > 0 ? thread_n_windows[pass][tid] / thread_time[pass][tid] / 1000000 : 0);
+		}
+	}
 	printf("Total hashing time: %.2f sec\n", omp_get_wtime() - start_time);
 }
 
+// --- Bucket sorting ---
+
+#define RADIX_SORT_MIN_BUCKET_SIZE 64
+#define RADIX_BITS 8
+#define RADIX_N_DIGITS (64/RADIX_BITS)
+#define RADIX_N_BINS (1 << RADIX_BITS)
+
+inline uint64 loc_sort_key(const loc_t& l) {
+	return ((uint64) l.hash << 32) | l.pos;
+}
+
+// sorts the bucket entries by (hash, pos)
+// small buckets are insertion sorted, large buckets use an LSD radix sort on the 64-bit (hash, pos) key
+// (digits that are the same across the bucket, e.g. the bucket id bits of the hash, are skipped)
+void sort_bucket(loc_t* bucket, const uint64 size, std::vector<loc_t>& tmp) {
+	if(size < RADIX_SORT_MIN_BUCKET_SIZE) {
+		for(uint64 i = 1; i < size; i++) {
+			loc_t l = bucket[i];
+			const uint64 key = loc_sort_key(l);
+			uint64 j = i;
+			for(; j > 0 && loc_sort_key(bucket[j-1]) > key; j--) {
+				bucket[j] = bucket[j-1];
+			}
+			bucket[j] = l;
+		}
+		return;
+	}
+
+	// histogram all the digits in one pass
+	uint32 counts[RADIX_N_DIGITS][RADIX_N_BINS] = { { 0 } };
+	bool is_sorted = true;
+	for(uint64 i = 0; i < size; i++) {
+		const uint64 key = loc_sort_key(bucket[i]);
+		for(uint32 d = 0; d < RADIX_N_DIGITS; d++) {
+			counts[d][(key >> (d*RADIX_BITS)) & (RADIX_N_BINS - 1)]++;
+		}
+		if(i > 0 && loc_sort_key(bucket[i-1]) > key) {
+			is_sorted = false;
+		}
+	}
+	if(is_sorted) return;
+
+	if(tmp.size() < size) {
+		tmp.resize(size);
+	}
+	loc_t* src = bucket;
+	loc_t* dst = &tmp[0];
+	for(uint32 d = 0; d < RADIX_N_DIGITS; d++) {
+		const uint32 shift = d*RADIX_BITS;
+		uint32* c = counts[d];
+		if(c[(loc_sort_key(src[0]) >> shift) & (RADIX_N_BINS - 1)] == size) {
+			continue; // all the entries share this digit
+		}
+		uint32 offset = 0;
+		for(uint32 b = 0; b < RADIX_N_BINS; b++) {
+			uint32 count = c[b];
+			c[b] = offset;
+			offset += count;
+		}
+		for(uint64 i = 0; i < size; i++) {
+			dst[c[(loc_sort_key(src[i]) >> shift) & (RADIX_N_BINS - 1)]++] = src[i];
+		}
+		std::swap(src, dst);
+	}
+	if(src != bucket) {
+		memcpy(bucket, src, size*sizeof(loc_t));
+	}
+}
+
+// sorts all the buckets of the flat index in parallel
+// (the buckets are the most significant digit of the sort, the remaining (hash, pos) digits are sorted per bucket)
+// (only the owned buffers can be sorted, the mapped index files are always stored sorted)
+void sort_index_buckets(static_index_t& index, const index_params_t* params) {
+	const uint64 n_total_buckets = index.bucket_offsets_buf.size() - 1;
+	omp_set_num_threads(params->n_threads);
+	#pragma omp parallel
+	{
+		std::vector<loc_t> tmp;
+		#pragma omp for schedule(dynamic, 4096)
+		for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+			const uint64 bucket_offset = index.bucket_offsets_buf[bid];
+			sort_bucket(&index.buckets_data_buf[bucket_offset], index.bucket_offsets_buf[bid+1] - bucket_offset, tmp);
+		}
+	}
+	index.sorted = true;
+}
+
+// --- Bucket hash directory ---
+
+// lists the distinct hashes of each sorted bucket and the index of their first entry
+// (the flat buckets are kept, the directory only replaces the search for the matching hash run)
+void build_index_hash_directory(static_index_t& index, const index_params_t* params) {
+	const uint64 n_total_buckets = index.bucket_offsets_buf.size() - 1;
+	index.bucket_dir_offsets_buf.resize(n_total_buckets + 1);
+	omp_set_num_threads(params->n_threads);
+	#pragma omp parallel for schedule(dynamic, 4096)
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		uint64 n_distinct = 0;
+		for(uint64 i = index.bucket_offsets_buf[bid]; i < index.bucket_offsets_buf[bid+1]; i++) {
+			if(i == index.bucket_offsets_buf[bid] || index.buckets_data_buf[i].hash != index.buckets_data_buf[i-1].hash) {
+				n_distinct++;
+			}
+		}
+		index.bucket_dir_offsets_buf[bid] = n_distinct;
+	}
+	uint64 n_dir_entries = 0;
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		const uint64 n_distinct = index.bucket_dir_offsets_buf[bid];
+		index.bucket_dir_offsets_buf[bid] = n_dir_entries;
+		n_dir_entries += n_distinct;
+	}
+	index.bucket_dir_offsets_buf[n_total_buckets] = n_dir_entries;
+	index.dir_hashes_buf.resize(n_dir_entries);
+	index.dir_starts_buf.resize(n_dir_entries);
+	#pragma omp parallel for schedule(dynamic, 4096)
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		const uint64 bucket_offset = index.bucket_offsets_buf[bid];
+		uint64 dir_idx = index.bucket_dir_offsets_buf[bid];
+		for(uint64 i = bucket_offset; i < index.bucket_offsets_buf[bid+1]; i++) {
+			if(i == bucket_offset || index.buckets_data_buf[i].hash != index.buckets_data_buf[i-1].hash) {
+				index.dir_hashes_buf[dir_idx] = index.buckets_data_buf[i].hash;
+				index.dir_starts_buf[dir_idx] = i - bucket_offset;
+				dir_idx++;
+			}
+		}
+	}
+	index.attach_buffers();
+}
+
+// --- Bucket columns ---
+
+// converts the flat buckets into the SoA layout (the flat entries are released)
+void split_index_columns(static_index_t& index, const index_params_t* params) {
+	const uint64 n_entries = index.buckets_data_buf.size();
+	index.bucket_hashes_buf.resize(n_entries);
+	index.bucket_pos_buf.resize(n_entries);
+	index.bucket_lens_buf.resize(n_entries);
+	omp_set_num_threads(params->n_threads);
+	#pragma omp parallel for
+	for(uint64 i = 0; i < n_entries; i++) {
+		index.bucket_hashes_buf[i] = index.buckets_data_buf[i].hash;
+		index.bucket_pos_buf[i] = index.buckets_data_buf[i].pos;
+		index.bucket_lens_buf[i] = index.buckets_data_buf[i].len;
+	}
+	std::vector<loc_t>().swap(index.buckets_data_buf);
+	index.layout = IDX_LAYOUT_SOA;
+	index.attach_buffers();
+}
+
+// --- Bucket packing ---
+
+// packs the sorted bucket entries into the packed layout and returns the number of bytes used
+// (when out is NULL only the number of bytes is computed)
+uint64 pack_bucket(const loc_t* bucket, const uint64 size, const uint32 pos_bytes, uint8* out) {
+	const uint64 n_blocks = (size + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+	uint64 n_bytes = n_blocks*sizeof(packed_block_t);
+	for(uint64 i = 0; i < size; i++) {
+		if(i % PACKED_BLOCK_SIZE == 0) {
+			if(out != NULL) {
+				packed_block_t block;
+				block.hash = bucket[i].hash;
+				block.pos = bucket[i].pos;
+				block.byte_offset = n_bytes;
+				memcpy(out + (i / PACKED_BLOCK_SIZE)*sizeof(packed_block_t), &block, sizeof(packed_block_t));
+			}
+		} else {
+			const minhash_t hash_delta = bucket[i].hash - bucket[i-1].hash;
+			if(hash_delta == 0) {
+				const seq_t pos_delta = bucket[i].pos - bucket[i-1].pos;
+				if(out != NULL) {
+					varint_encode(pos_delta, varint_encode(hash_delta, out + n_bytes));
+				}
+				n_bytes += varint_size(hash_delta) + varint_size(pos_delta);
+			} else {
+				if(out != NULL) {
+					fixed_encode(bucket[i].pos, pos_bytes, varint_encode(hash_delta, out + n_bytes));
+				}
+				n_bytes += varint_size(hash_delta) + pos_bytes;
+			}
+		}
+		if(out != NULL) {
+			varint_encode(bucket[i].len, out + n_bytes);
+		}
+		n_bytes += varint_size(bucket[i].len);
+	}
+	return n_bytes;
+}
+
+// converts the sorted flat buckets into the packed layout (the flat entries are released)
+void pack_index_buckets(static_index_t& index, const index_params_t* params) {
+	const uint64 n_total_buckets = index.bucket_offsets_buf.size() - 1;
+	index.bucket_byte_offsets_buf.resize(n_total_buckets + 1);
+	omp_set_num_threads(params->n_threads);
+	seq_t max_pos = 0;
+	#pragma omp parallel for reduction(max:max_pos)
+	for(uint64 i = 0; i < index.buckets_data_buf.size(); i++) {
+		max_pos = std::max(max_pos, index.buckets_data_buf[i].pos);
+	}
+	index.packed_pos_bytes = 1;
+	while(index.packed_pos_bytes < sizeof(seq_t) && (max_pos >> (8*index.packed_pos_bytes)) != 0) {
+		index.packed_pos_bytes++;
+	}
+	#pragma omp parallel for schedule(dynamic, 4096)
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		const uint64 bucket_offset = index.bucket_offsets_buf[bid];
+		index.bucket_byte_offsets_buf[bid] = pack_bucket(&index.buckets_data_buf[bucket_offset],
+				index.bucket_offsets_buf[bid+1] - bucket_offset, index.packed_pos_bytes, NULL);
+	}
+	uint64 n_packed_bytes = 0;
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		const uint64 n_bytes = index.bucket_byte_offsets_buf[bid];
+		index.bucket_byte_offsets_buf[bid] = n_packed_bytes;
+		n_packed_bytes += n_bytes;
+	}
+	index.bucket_byte_offsets_buf[n_total_buckets] = n_packed_bytes;
+	index.packed_data_buf.resize(n_packed_bytes);
+	#pragma omp parallel for schedule(dynamic, 4096)
+	for(uint64 bid = 0; bid < n_total_buckets; bid++) {
+		const uint64 bucket_offset = index.bucket_offsets_buf[bid];
+		pack_bucket(&index.buckets_data_buf[bucket_offset], index.bucket_offsets_buf[bid+1] - bucket_offset,
+				index.packed_pos_bytes, index.packed_data_buf.data() + index.bucket_byte_offsets_buf[bid]);
+	}
+	index.n_entries = index.buckets_data_buf.size();
+	std::vector<loc_t>().swap(index.buckets_data_buf);
+	index.layout = IDX_LAYOUT_PACKED;
+	index.attach_buffers();
+}
+
 void load_index_ref_lsh(const char* fastaFname, const index_params_t* params, ref_t& ref) {
-	printf("Loading FASTA file %s... \n", fastaFname);
+	printf("Loading reference %s... \n", fastaFname);
 	clock_t t = clock();
-	fasta2ref(fastaFname, ref);
+	load_packed_ref(fastaFname, ref); // the alignment only accesses the packed reference
 	printf("Time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
 	printf("Loading frequent kmers... \n");
 	t = clock();
-	load_freq_kmers(fastaFname, ref.high_freq_kmer_bitmap, ref.high_freq_kmer_trie, params->max_count);
+	load_freq_kmers(fastaFname, ref.high_freq_kmer_filter, ref.high_freq_kmer_trie, params);
 	printf("Time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 
 	if(params->load_mhi) {
@@ -256,46 +538,47 @@ void store_index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t&
 	printf("Reference index storing time: %.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 }
 
+#define FREQ_KMERS_CHUNK_SIZE (1 << 16) // multiple of 64: the chunks do not share bitmask words
+
 void mark_freq_kmers(ref_t& ref, const index_params_t* params) {
-	clock_t t = clock();
-	ref.ignore_kmer_bitmask.resize(ref.len - params->k);
-	#pragma omp parallel for
-	for(seq_t i = 0; i < ref.len - params->k + 1; i++) { // for each window of the genome
-#if USE_MARISA
-		marisa::Agent agent;
-		for (uint32 k = 0; k < params->k; k++) {
-			if(ref.seq.c_str()[i+k] == BASE_IGNORE) {
+	double start_time = omp_get_wtime();
+	const seq_t n_kmers = ref.len - params->k + 1;
+	ref.ignore_kmer_bitmask.resize(n_kmers);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(seq_t chunk_start = 0; chunk_start < n_kmers; chunk_start += FREQ_KMERS_CHUNK_SIZE) {
+		const seq_t chunk_end = std::min(chunk_start + FREQ_KMERS_CHUNK_SIZE, n_kmers);
+		kmer_iter_t kmer_iter(ref.seq.c_str(), params->k);
+		kmer_iter.reset(chunk_start);
+		for(seq_t i = chunk_start; i < chunk_end; i++) { // for each kmer of the chunk
+			if(i != chunk_start) {
+				kmer_iter.next();
+			}
+			if(!kmer_iter.valid()) {
 				ref.ignore_kmer_bitmask[i] = 1; // contains ambiguous bases
-				break;
+				continue;
+			}
+#if USE_MARISA
+			marisa::Agent agent;
+			agent.set_query(&ref.seq.c_str()[i], params->k);
+			if(ref.high_freq_kmer_trie.lookup(agent)) {
+				ref.ignore_kmer_bitmask[i] = 1;
 			}
-		}
-		agent.set_query(&ref.seq.c_str()[i], params->k);
-		if(ref.high_freq_kmer_trie.lookup(agent)) {
-			ref.ignore_kmer_bitmask[i] = 1;
-		}
 #else
-		uint32_t packed_kmer;
-		if(pack_32(&ref.seq.c_str()[i], params->k, &packed_kmer) < 0) {
-			ref.ignore_kmer_bitmask[i] = 1; // contains ambiguous bases
-			continue;
-		}
-		if(ref.high_freq_kmer_bitmap[packed_kmer]) {
-			ref.ignore_kmer_bitmask[i] = 1;
-		}
+			if(ref.high_freq_kmer_filter.contains(kmer_iter.packed())) {
+				ref.ignore_kmer_bitmask[i] = 1;
+			}
 #endif
+		}
 	}
-	printf("Done marking frequent kmers time: %.2f sec \n", (float) (clock() - t)/CLOCKS_PER_SEC);
+	double elapsed = omp_get_wtime() - start_time;
+	printf("Done marking frequent kmers time: %.2f sec (%.2f ns/kmer) \n", elapsed, 1e9*elapsed/n_kmers);
 }
 
 // checks if the given sequence is informative or not
 // e.g. non-informative seq: same character is repeated throughout the seq (NN...N)
 #define AMBIG_BASE_FRAC 50
 #define LOW_BASE_FRAC 100
-int is_inform_ref_window(const char* seq, const uint32_t len, const index_params_t* params) {
-	uint32 base_counts[5] = { 0 };
-	for(uint32 i = 0; i < len; i++) {
-		base_counts[(int) seq[i]]++;
-	}
+int is_inform_base_counts(const uint32* base_counts, const index_params_t* params) {
 	if(base_counts[4] > params->ref_window_size/AMBIG_BASE_FRAC) { // N ambiguous bases
 		return 0;
 	}
@@ -315,12 +598,38 @@ int is_inform_ref_window(const char* seq, const uint32_t len, const index_params
 	return 1;
 }
 
+int is_inform_ref_window(const char* seq, const uint32_t len, const index_params_t* params) {
+	uint32 base_counts[5] = { 0 };
+	for(uint32 i = 0; i < len; i++) {
+		base_counts[(int) seq[i]]++;
+	}
+	return is_inform_base_counts(base_counts, params);
+}
+
+#define WINDOW_MASK_CHUNK_SIZE (1 << 16) // multiple of 64: the chunks do not share bitmask words
+
+// the base counts are updated by one base in and one base out per window
 void mark_windows_to_discard(ref_t& ref, const index_params_t* params) {
-	ref.ignore_window_bitmask.resize(ref.len - params->ref_window_size + 1);
-	#pragma omp parallel for
-	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) { // for each window of the genome
-		if(!is_inform_ref_window(&ref.seq.c_str()[pos], params->ref_window_size, params)) {
-			ref.ignore_window_bitmask[pos] = 1; // discard windows with low information content
+	double start_time = omp_get_wtime();
+	const seq_t n_windows = ref.len - params->ref_window_size + 1;
+	const char* seq = ref.seq.c_str();
+	ref.ignore_window_bitmask.resize(n_windows);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(seq_t chunk_start = 0; chunk_start < n_windows; chunk_start += WINDOW_MASK_CHUNK_SIZE) {
+		const seq_t chunk_end = std::min(chunk_start + WINDOW_MASK_CHUNK_SIZE, n_windows);
+		uint32 base_counts[5] = { 0 };
+		for(uint32 i = 0; i < params->ref_window_size; i++) {
+			base_counts[(int) seq[chunk_start + i]]++;
+		}
+		for(seq_t pos = chunk_start; pos < chunk_end; pos++) { // for each window of the chunk
+			if(pos != chunk_start) {
+				base_counts[(int) seq[pos - 1]]--;
+				base_counts[(int) seq[pos + params->ref_window_size - 1]]++;
+			}
+			if(!is_inform_base_counts(base_counts, params)) {
+				ref.ignore_window_bitmask[pos] = 1; // discard windows with low information content
+			}
 		}
 	}
+	printf("Done marking low-information windows time: %.2f sec \n", omp_get_wtime() - start_time);
 }
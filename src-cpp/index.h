@@ -3,11 +3,18 @@
 
 #pragma once
 
-typedef enum {SIMH, MINH, SAMPLE} algorithm;
+typedef enum {SIMH, MINH, SAMPLE, OPH} algorithm; // OPH: one-permutation min-hash
 typedef enum {OVERLAP, NON_OVERLAP, SPARSE} kmer_selection;
 typedef enum {SHA1_E = 0, CITY_HASH64 = 1, PACK64 = 2} kmer_hash_alg;
+typedef enum {IDX_LAYOUT_FLAT = 0, IDX_LAYOUT_PACKED = 1, IDX_LAYOUT_SOA = 2} idx_layout;
+typedef enum {IDX_PREFETCH_NONE = 0, IDX_PREFETCH_POPULATE = 1, IDX_PREFETCH_WILLNEED = 2} idx_prefetch_mode;
 
+#include <sys/mman.h>
+#include <string.h>
 #include "hash.h"
+#include "filter.h"
+#include "packed_seq.h"
+#include "arena.h"
 
 #define DISK_SYNC_PARTIAL_TABLES 0
 
@@ -36,6 +43,8 @@ typedef struct {
 	// sequence kmer filtering
 	uint64 max_count;				// upper bound on kmer occurrence in the reference
 	uint64 min_count;				// lower bound on kmer occurrence in the read set
+	freq_filter_type freq_filter;	// representation of the high-frequency kmer set
+	uint32 kmer_count_mem_mb;		// memory budget for counting the reference kmers (MB), 0 - half of the physical memory
 
 	// alignment evaluation
 	uint32 k2; 						// length of the sequence kmers for vote counting
@@ -62,12 +71,19 @@ typedef struct {
 	// io
 	std::string in_index_fname;
 	std::string out_index_fname;
+	idx_layout layout;				// representation of the index buckets
+	bool hash_dir;					// build the per-bucket directory of distinct hashes
+	idx_prefetch_mode idx_prefetch;	// how to prefetch the pages of the mapped index
+	bool verify_index;				// verify the index data and reference checksums on load
+
+	uint32 read_batch_size;			// number of reads aligned at a time, 0 - all the reads at once
 
 	bool load_mhi;
 	std::string precomp_contig_file_name;
 	bool monolith;
 
 	void set_default_index_params() {
+		alg = MINH;
 		kmer_type = OVERLAP;
 		kmer_hashing_alg = SHA1_E;
 		h = 64;
@@ -81,6 +97,8 @@ typedef struct {
 		ref_window_size = 1000;
 		max_count = 300;
 		min_count = 0;
+		freq_filter = FREQ_FILTER_AUTO;
+		kmer_count_mem_mb = 0;
 		k2 = 32;
 		precomp_k2 = true;
 		min_n_hits = 2;
@@ -94,6 +112,11 @@ typedef struct {
 		mapq_scale_x = 100;
 		sampling_intv = 1;
 		n_threads = 1;
+		layout = IDX_LAYOUT_FLAT;
+		hash_dir = false;
+		idx_prefetch = IDX_PREFETCH_NONE;
+		verify_index = false;
+		read_batch_size = 0;
 	}
 
 	// set the initial kmer hash function (rolling hash)
@@ -142,46 +165,224 @@ typedef struct {
 // **** Reference Index ****
 typedef std::map<uint32, seq_t> MapKmerCounts;
 
-// min-hash signature index
-struct buckets_t {
-	uint32 n_entries; // total number of entries across all buckets
-	std::vector<VectorSeqPos> buckets_data_vectors;
-
-	// per thread local buckets
-	std::vector<std::vector<VectorSeqPos> > per_thread_buckets_data_vectors;
-	std::vector<VectorU32> per_thread_bucket_sizes;
+// packed bucket layout:
+// the entries of each bucket are split into blocks of PACKED_BLOCK_SIZE entries;
+// a bucket starts with the headers of its blocks (hash and pos of the first entry, byte offset of the block)
+// followed by the block entries: len for the first entry of the block and (hash delta, pos, len) for the rest;
+// the hash delta and len are varints, the pos is a varint delta when the hash does not change and
+// a fixed-width integer of packed_pos_bytes bytes otherwise
+#define PACKED_BLOCK_SIZE 16
+
+struct packed_block_t {
+	minhash_t hash;
+	seq_t pos;
+	uint32 byte_offset;		// offset of the block entries from the start of the bucket
 };
 
-typedef struct {
-	std::vector<buckets_t> per_table_buckets; // buckets for T tables
-} mutable_index_t;
+inline uint32 varint_size(uint32 v) {
+	uint32 n = 1;
+	while(v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+inline uint8* varint_encode(uint32 v, uint8* out) {
+	while(v >= 0x80) {
+		*out++ = (uint8) (v | 0x80);
+		v >>= 7;
+	}
+	*out++ = (uint8) v;
+	return out;
+}
+
+inline uint32 varint_decode(const uint8*& in) {
+	uint32 v = *in & 0x7F;
+	uint32 shift = 7;
+	while(*in++ & 0x80) {
+		v |= (uint32) (*in & 0x7F) << shift;
+		shift += 7;
+	}
+	return v;
+}
+
+inline uint8* fixed_encode(uint32 v, const uint32 n_bytes, uint8* out) {
+	for(uint32 i = 0; i < n_bytes; i++) {
+		*out++ = (uint8) v;
+		v >>= 8;
+	}
+	return out;
+}
+
+inline uint32 fixed_decode(const uint8*& in, const uint32 n_bytes) {
+	uint32 v = 0;
+	for(uint32 i = 0; i < n_bytes; i++) {
+		v |= (uint32) *in++ << (8*i);
+	}
+	return v;
+}
+
+inline packed_block_t packed_bucket_block(const uint8* bucket, const uint32 block_idx) {
+	packed_block_t block;
+	memcpy(&block, bucket + block_idx*sizeof(packed_block_t), sizeof(packed_block_t));
+	return block;
+}
+
+// min-hash signature index
+// the bucket arrays point either into the owned buffers (index built or read into memory)
+// or directly into a read-only mapping of the index file
+struct static_index_t {
+	idx_layout layout;
+	const loc_t* buckets_data;		// stores the bucket entries across all the tables (flat layout)
+	const uint64* bucket_offsets;	// stores offsets for each bucket id (in entries)
+	uint64 n_entries;				// number of bucket entries
+	uint64 n_bucket_offsets;		// number of bucket ids + 1
+	const uint64* bucket_byte_offsets; // stores byte offsets for each bucket id (packed layout)
+	const uint8* packed_data;		// packed bucket entries across all the tables (packed layout)
+	uint64 n_packed_bytes;
+	uint32 packed_pos_bytes;		// width of the positions that are not delta-encoded (packed layout)
+	const minhash_t* bucket_hashes;	// hash column of the bucket entries (SoA layout)
+	const seq_t* bucket_pos;		// pos column of the bucket entries (SoA layout)
+	const len_t* bucket_lens;		// len column of the bucket entries (SoA layout)
+	const uint64* bucket_dir_offsets; // offsets of each bucket in the hash directory (optional, flat layout)
+	const minhash_t* dir_hashes;	// distinct hashes of each bucket, sorted
+	const uint32* dir_starts;		// index of the first bucket entry with the corresponding hash
+	uint64 n_dir_entries;
+	bool sorted;					// entries of each bucket are ordered by (hash, pos)
+
+	// owned storage
+	std::vector<loc_t> buckets_data_buf;
+	std::vector<uint64> bucket_offsets_buf;
+	std::vector<uint64> bucket_byte_offsets_buf;
+	VectorU8 packed_data_buf;
+	VectorMinHash bucket_hashes_buf;
+	std::vector<seq_t> bucket_pos_buf;
+	std::vector<len_t> bucket_lens_buf;
+	std::vector<uint64> bucket_dir_offsets_buf;
+	VectorMinHash dir_hashes_buf;
+	VectorU32 dir_starts_buf;
+
+	// mapped index file
+	void* mmap_addr;
+	size_t mmap_len;
+
+	static_index_t() : layout(IDX_LAYOUT_FLAT), buckets_data(NULL), bucket_offsets(NULL), n_entries(0), n_bucket_offsets(0),
+			bucket_byte_offsets(NULL), packed_data(NULL), n_packed_bytes(0), packed_pos_bytes(0),
+			bucket_hashes(NULL), bucket_pos(NULL), bucket_lens(NULL), bucket_dir_offsets(NULL), dir_hashes(NULL), dir_starts(NULL), n_dir_entries(0), sorted(false), mmap_addr(NULL), mmap_len(0) {}
+
+	// point the index arrays to the owned buffers
+	void attach_buffers() {
+		bucket_offsets = bucket_offsets_buf.data();
+		n_bucket_offsets = bucket_offsets_buf.size();
+		if(layout == IDX_LAYOUT_PACKED) {
+			buckets_data = NULL;
+			bucket_byte_offsets = bucket_byte_offsets_buf.data();
+			packed_data = packed_data_buf.data();
+			n_packed_bytes = packed_data_buf.size();
+		} else if(layout == IDX_LAYOUT_SOA) {
+			buckets_data = NULL;
+			bucket_hashes = bucket_hashes_buf.data();
+			bucket_pos = bucket_pos_buf.data();
+			bucket_lens = bucket_lens_buf.data();
+			n_entries = bucket_hashes_buf.size();
+		} else {
+			buckets_data = buckets_data_buf.data();
+			n_entries = buckets_data_buf.size();
+		}
+		if(bucket_dir_offsets_buf.size() != 0) {
+			bucket_dir_offsets = bucket_dir_offsets_buf.data();
+			dir_hashes = dir_hashes_buf.data();
+			dir_starts = dir_starts_buf.data();
+			n_dir_entries = dir_hashes_buf.size();
+		}
+	}
 
-typedef struct {
-	// stores the bucket entries across all the tables
-	std::vector<loc_t> buckets_data;
-	// stores offsets for each bucket id
-	std::vector<uint64> bucket_offsets;
 	void release() {
-		std::vector<loc_t>().swap(buckets_data);
-		std::vector<uint64>().swap(bucket_offsets);
+		if(mmap_addr != NULL) {
+			munmap(mmap_addr, mmap_len);
+			mmap_addr = NULL;
+			mmap_len = 0;
+		}
+		std::vector<loc_t>().swap(buckets_data_buf);
+		std::vector<uint64>().swap(bucket_offsets_buf);
+		std::vector<uint64>().swap(bucket_byte_offsets_buf);
+		VectorU8().swap(packed_data_buf);
+		VectorMinHash().swap(bucket_hashes_buf);
+		std::vector<seq_t>().swap(bucket_pos_buf);
+		std::vector<len_t>().swap(bucket_lens_buf);
+		std::vector<uint64>().swap(bucket_dir_offsets_buf);
+		VectorMinHash().swap(dir_hashes_buf);
+		VectorU32().swap(dir_starts_buf);
+		layout = IDX_LAYOUT_FLAT;
+		buckets_data = NULL;
+		bucket_offsets = NULL;
+		bucket_byte_offsets = NULL;
+		packed_data = NULL;
+		n_entries = 0;
+		n_bucket_offsets = 0;
+		n_packed_bytes = 0;
+		packed_pos_bytes = 0;
+		bucket_hashes = NULL;
+		bucket_pos = NULL;
+		bucket_lens = NULL;
+		bucket_dir_offsets = NULL;
+		dir_hashes = NULL;
+		dir_starts = NULL;
+		n_dir_entries = 0;
+		sorted = false;
 	}
 
-} static_index_t;
+	// prefetches the offsets of the given bucket (first stage of a bucket probe)
+	inline void prefetch_bucket_offsets(const uint64 bid) const {
+		_mm_prefetch((const char*) &bucket_offsets[bid], _MM_HINT_T0);
+		if(layout == IDX_LAYOUT_PACKED) {
+			_mm_prefetch((const char*) &bucket_byte_offsets[bid], _MM_HINT_T0);
+		} else if(layout == IDX_LAYOUT_FLAT && bucket_dir_offsets != NULL) {
+			_mm_prefetch((const char*) &bucket_dir_offsets[bid], _MM_HINT_T0);
+		}
+	}
+
+	// prefetches the first and middle lines of the array searched for the read hash in the given bucket
+	// (second stage of a bucket probe, the bucket offsets should be cached by now)
+	inline void prefetch_bucket_head(const uint64 bid) const {
+		const uint64 offset = bucket_offsets[bid];
+		const uint64 size = bucket_offsets[bid+1] - offset;
+		const char* head;
+		uint64 mid_offset;
+		if(layout == IDX_LAYOUT_PACKED) {
+			head = (const char*) (packed_data + bucket_byte_offsets[bid]);
+			mid_offset = ((size + PACKED_BLOCK_SIZE - 1)/PACKED_BLOCK_SIZE/2)*sizeof(packed_block_t);
+		} else if(layout == IDX_LAYOUT_SOA) {
+			head = (const char*) (bucket_hashes + offset);
+			mid_offset = (size/2)*sizeof(minhash_t);
+		} else if(bucket_dir_offsets != NULL) {
+			head = (const char*) (dir_hashes + bucket_dir_offsets[bid]);
+			mid_offset = ((bucket_dir_offsets[bid+1] - bucket_dir_offsets[bid])/2)*sizeof(minhash_t);
+		} else {
+			head = (const char*) (buckets_data + offset);
+			mid_offset = (size/2)*sizeof(loc_t);
+		}
+		_mm_prefetch(head, _MM_HINT_T0);
+		_mm_prefetch(head + mid_offset, _MM_HINT_T0);
+	}
+};
 
 // reference genome index
 typedef struct {
-	std::string seq; 					// reference sequence
+	std::string seq; 					// reference sequence (nt4 codes, released in align mode)
+	packed_seq_t packed_seq;			// 2-bit packed reference sequence and N runs
 	seq_t len;							// reference sequence length
 	VectorU32 subsequence_offsets;
+	std::vector<std::string> subsequence_names;
 
 	MapKmerCounts kmer_hist;			// kmer occurrence histogram
 	MarisaTrie high_freq_kmer_trie;		// frequent reference kmers TRIE
-	VectorBool high_freq_kmer_bitmap;	// frequent reference kmers bitmap
+	freq_kmer_filter_t high_freq_kmer_filter; // frequent reference kmers filter
 	VectorBool ignore_kmer_bitmask;
 	VectorBool ignore_window_bitmask;
 
 	// lsh
-	mutable_index_t mutable_index;
 	static_index_t index;
 
 	// voting
@@ -214,21 +415,20 @@ struct aln_t {
 	int total_votes;		// total number of kmers that matched
 };
 
+// per-read alignment state
+// the sequences, names and fixed-size phase outputs live in the arenas of the read batch
+// (read_t is trivially destructible, releasing a batch does not visit the reads)
 struct read_t {
 	uint32_t len; 					// read length
-	std::string name; 				// read name
-	std::string seq;				// read sequence
-	std::string rc;					// reverse complement sequence
-	std::string qual;				// quality scores
-	uint32 rid;
-
-	// kmer hashes (unique, shuffled)
-	std::vector<minhash_t> kmer_ciphers_phase1_f;
-	std::vector<minhash_t> kmer_ciphers_phase1_rc;
+	const char* name; 				// read name ('\0'-terminated)
+	const char* seq;				// read sequence (nt4)
+	const char* rc;					// reverse complement sequence (nt4)
+	uint64 name_offset;				// offsets of the name and the sequences in the batch arenas
+	uint64 seq_offset;
 
 	// LSH sketches
-	VectorMinHash minhashes_f;		// minhash vector
-	VectorMinHash minhashes_rc;		// minhash vector for the reverse complement
+	minhash_t* minhashes_f;			// minhash vector
+	minhash_t* minhashes_rc;		// minhash vector for the reverse complement
 	char valid_minhash_f;
 	char valid_minhash_rc;
 
@@ -240,17 +440,15 @@ struct read_t {
 	uint64 key2_mult_pad;
 
 	// alignment information
-	VectorU32 ref_bucket_id_matches_by_table;
-	std::vector<std::pair<uint64, minhash_t>> ref_bucket_matches_by_table_f;
-	std::vector<std::pair<uint64, minhash_t>> ref_bucket_matches_by_table_rc;
+	std::pair<uint64, minhash_t>* ref_bucket_matches_by_table_f;
+	std::pair<uint64, minhash_t>* ref_bucket_matches_by_table_rc;
 	char ref_strand;
 
-	// local csr buckets
-	std::vector<loc_t> buckets;
-	std::vector<int> bucket_offsets;
-
-	std::vector<ref_match_t> ref_matches;
-	std::vector<kmer_cipher_t*> contig_kmer_ciphers;
+	ref_match_t* ref_matches;		// matched reference contigs
+	uint32 n_ref_matches;
+	uint32 ref_matches_arena;		// location of the contigs in the per-thread arenas of the batch
+	uint64 ref_matches_offset;
+	kmer_cipher_t** contig_kmer_ciphers;
 
 	int best_n_bucket_hits;
 	int true_n_bucket_hits;
@@ -261,8 +459,6 @@ struct read_t {
 	int max_total_votes_low_anchors;
 
 	// simulation alignment info/stats
-	char acc; // DEBUG: whether read matched accurately
-	char top_hit_acc;
 	char dp_hit_acc;
 	bool collected_true_hit;
 	bool processed_true_hit;
@@ -278,17 +474,32 @@ struct read_t {
 
 	read_t() {
 		len = 0;
-		rid = 0;
-
+		name = NULL;
+		seq = NULL;
+		rc = NULL;
+		name_offset = 0;
+		seq_offset = 0;
+
+		minhashes_f = NULL;
+		minhashes_rc = NULL;
 		valid_minhash_f = 0;
 		valid_minhash_rc = 0;
 		best_n_bucket_hits = 0;
 		true_n_bucket_hits = 0;
 		any_bucket_hits = false;
+		kmers_f = NULL;
+		kmers_rc = NULL;
 		key1_xor_pad = 0;
 		key2_mult_pad = 0;
 
 		// alignment info
+		ref_bucket_matches_by_table_f = NULL;
+		ref_bucket_matches_by_table_rc = NULL;
+		ref_matches = NULL;
+		n_ref_matches = 0;
+		ref_matches_arena = 0;
+		ref_matches_offset = 0;
+		contig_kmer_ciphers = NULL;
 		top_aln.score = 0;
 		top_aln.ref_start = 0;
 		top_aln.inlier_votes = 0;
@@ -300,14 +511,12 @@ struct read_t {
 		ref_strand = 0;
 
 		// simulation alignment info/stats
-		acc = 0;
 		collected_true_hit = 0;
 		processed_true_hit = false;
 		bucketed_true_hit = 0;
 		comp_votes_hit = 0;
 		n_proc_contigs = 0;
 		dp_hit_acc = 0;
-		top_hit_acc = 0;
 		strand = 0;
 		seq_id = 0;
 		ref_pos_l = 0;
@@ -317,18 +526,63 @@ struct read_t {
 typedef std::vector<read_t> VectorReads;
 typedef std::vector<read_t*> VectorPReads;
 
-// collection of reads
-typedef struct {
+// batch of reads, the variable-size read data and the phase outputs are stored in contiguous arenas
+// (the arenas keep their capacity when the batch is reused, clearing a batch is O(1))
+struct read_batch_t {
 	const char* fname;
-	VectorReads reads;				// read data
-	MapKmerCounts kmer_hist;		// kmer histogram
-	MapKmerCounts low_freq_kmer_hist;
-} reads_t;
+	VectorReads reads;				// per-read state, indexed by read id
+	std::vector<char> names;		// read names
+	std::vector<char> seqs;			// sequence followed by the reverse complement of each read
+	VectorMinHash minhashes;		// h forward and h reverse complement minhashes per read
+	std::vector<std::pair<uint64, minhash_t> > bucket_matches; // n_tables forward and n_tables rc buckets per read
+	std::vector<VectorRefMatches> ref_matches; // per-thread arenas of the matched contigs
+	std::vector<kmer_cipher_t*> contig_kmer_ciphers; // one entry per matched contig
+	std::vector<bump_arena_t> cipher_arenas; // per-thread arenas of the phase 2 read and contig ciphers
+
+	read_batch_t() : fname(NULL) {}
+
+	void clear() {
+		reads.clear();
+		names.clear();
+		seqs.clear();
+		minhashes.clear();
+		bucket_matches.clear();
+		for(uint32 i = 0; i < ref_matches.size(); i++) {
+			ref_matches[i].clear();
+		}
+		contig_kmer_ciphers.clear();
+		for(uint32 i = 0; i < cipher_arenas.size(); i++) {
+			cipher_arenas[i].reset();
+		}
+	}
+
+	// point the reads to their names and sequences (after the arenas stop growing)
+	void attach_seqs() {
+		for(uint32 i = 0; i < reads.size(); i++) {
+			read_t* r = &reads[i];
+			r->name = &names[r->name_offset];
+			r->seq = &seqs[r->seq_offset];
+			r->rc = &seqs[r->seq_offset + r->len];
+		}
+	}
+
+	// point the reads to their matched contigs (after the arenas stop growing)
+	void attach_ref_matches() {
+		for(uint32 i = 0; i < reads.size(); i++) {
+			read_t* r = &reads[i];
+			r->ref_matches = (r->n_ref_matches > 0) ? &ref_matches[r->ref_matches_arena][r->ref_matches_offset] : NULL;
+		}
+	}
+};
 
 void index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& refidx);
 void load_index_ref_lsh(const char* fastaFname, const index_params_t* params, ref_t& ref);
 void store_index_ref_lsh(const char* fastaFname, index_params_t* params, ref_t& ref);
-void index_reads_lsh(const char* readsFname, ref_t& ref, index_params_t* params, reads_t& ridx);
+void sort_index_buckets(static_index_t& index, const index_params_t* params);
+void pack_index_buckets(static_index_t& index, const index_params_t* params);
+void build_index_hash_directory(static_index_t& index, const index_params_t* params);
+void split_index_columns(static_index_t& index, const index_params_t* params);
+void index_reads_lsh(const char* readsFname, ref_t& ref, index_params_t* params, read_batch_t& ridx);
 void ref_kmer_fingerprint_stats(const char* fastaFname, index_params_t* params, ref_t& ref);
 
 #endif /*INDEX_H_*/
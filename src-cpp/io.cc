@@ -6,9 +6,177 @@
 #include <fstream>
 #include <omp.h>
 #include <limits.h>
+#include <time.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <smmintrin.h>
+#include <ctype.h>
 #include "io.h"
 #include "types.h"
 
+/* Compressed input */
+
+// opens the file and detects its format from the gzip header
+// (BGZF blocks are gzip members with a 'BC' extra subfield storing the block size)
+bool seq_file_t::open(const char* fname) {
+	fd = ::open(fname, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	uint8 header[BGZF_HEADER_SIZE];
+	const ssize_t n = pread(fd, header, BGZF_HEADER_SIZE, 0);
+	format = SEQ_FILE_PLAIN;
+	if(n >= 2 && header[0] == 0x1f && header[1] == 0x8b) {
+		format = SEQ_FILE_GZIP;
+		if(n == BGZF_HEADER_SIZE && (header[3] & 4) && header[12] == 'B' && header[13] == 'C') {
+			format = SEQ_FILE_BGZF;
+		}
+	}
+	if(format == SEQ_FILE_GZIP) {
+		gz = gzdopen(dup(fd), "rb");
+		if(gz == NULL) {
+			return false;
+		}
+		gzbuffer(gz, SEQ_FILE_BUF_SIZE);
+	}
+	buf.resize(SEQ_FILE_BUF_SIZE);
+	buf_pos = 0;
+	buf_len = 0;
+	at_eof = false;
+	input_done = false;
+	return true;
+}
+
+void seq_file_t::close() {
+	if(gz != NULL) {
+		gzclose(gz);
+		gz = NULL;
+	}
+	if(fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+// reads the next block of data into the buffer, returns false at the end of the file
+bool seq_file_t::fill() {
+	buf_pos = 0;
+	buf_len = 0;
+	while(buf_len == 0 && !input_done) {
+		if(format == SEQ_FILE_PLAIN) {
+			const ssize_t n = read(fd, buf.data(), buf.size());
+			if(n < 0) {
+				printf("seq_file: Read error!\n");
+				exit(1);
+			}
+			buf_len = n;
+			input_done = (n == 0);
+		} else if(format == SEQ_FILE_GZIP) {
+			const int n = gzread(gz, buf.data(), buf.size());
+			if(n < 0) {
+				printf("seq_file: Corrupted gzip data!\n");
+				exit(1);
+			}
+			buf_len = n;
+			input_done = (n == 0);
+		} else {
+			fill_bgzf();
+		}
+	}
+	return buf_len > 0;
+}
+
+// reads the next batch of BGZF blocks and inflates them in parallel into the buffer
+void seq_file_t::fill_bgzf() {
+	// append the compressed data after the incomplete block left from the previous batch
+	bgzf_data.resize(BGZF_BATCH_SIZE);
+	while(bgzf_len < BGZF_BATCH_SIZE) {
+		const ssize_t n = read(fd, &bgzf_data[bgzf_len], BGZF_BATCH_SIZE - bgzf_len);
+		if(n < 0) {
+			printf("seq_file: Read error!\n");
+			exit(1);
+		}
+		if(n == 0) {
+			break;
+		}
+		bgzf_len += n;
+	}
+
+	// locate the complete blocks
+	std::vector<uint64> block_starts;
+	std::vector<uint64> out_offsets(1, 0);
+	uint64 pos = 0;
+	while(pos + BGZF_HEADER_SIZE <= bgzf_len) {
+		const uint8* h = reinterpret_cast<const uint8*>(&bgzf_data[pos]);
+		if(h[0] != 0x1f || h[1] != 0x8b || !(h[3] & 4) || h[12] != 'B' || h[13] != 'C') {
+			printf("seq_file: Corrupted BGZF block!\n");
+			exit(1);
+		}
+		const uint64 block_size = (h[16] | (h[17] << 8)) + 1;
+		if(pos + block_size > bgzf_len) {
+			break;
+		}
+		const uint8* t = h + block_size - 4;
+		const uint64 isize = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint64) t[3] << 24);
+		block_starts.push_back(pos);
+		out_offsets.push_back(out_offsets.back() + isize);
+		pos += block_size;
+	}
+	if(block_starts.size() == 0) {
+		if(bgzf_len != 0) {
+			printf("seq_file: Truncated BGZF file!\n");
+			exit(1);
+		}
+		input_done = true;
+		return;
+	}
+
+	if(buf.size() < out_offsets.back()) {
+		buf.resize(out_offsets.back());
+	}
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(uint32 b = 0; b < block_starts.size(); b++) {
+		const uint8* h = reinterpret_cast<const uint8*>(&bgzf_data[block_starts[b]]);
+		const uint64 block_size = (h[16] | (h[17] << 8)) + 1;
+		const uint64 header_size = 12 + (h[10] | (h[11] << 8));
+		const uint64 out_size = out_offsets[b+1] - out_offsets[b];
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		inflateInit2(&zs, -15); // raw deflate data
+		zs.next_in = const_cast<Bytef*>(h + header_size);
+		zs.avail_in = block_size - header_size - 8;
+		zs.next_out = reinterpret_cast<Bytef*>(&buf[out_offsets[b]]);
+		zs.avail_out = out_size;
+		const int ret = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+		const uint8* t = h + block_size - 8;
+		const uint32 crc = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32) t[3] << 24);
+		if(ret != Z_STREAM_END || zs.total_out != out_size ||
+				crc32(0L, reinterpret_cast<const Bytef*>(&buf[out_offsets[b]]), out_size) != crc) {
+			printf("seq_file: Corrupted BGZF block!\n");
+			exit(1);
+		}
+	}
+	buf_len = out_offsets.back();
+
+	memmove(&bgzf_data[0], &bgzf_data[pos], bgzf_len - pos);
+	bgzf_len -= pos;
+}
+
+// reads the remaining (decompressed) content of the file
+void seq_file_t::read_all(std::vector<char>& out) {
+	out.clear();
+	out.insert(out.end(), buf.begin() + buf_pos, buf.begin() + buf_len);
+	while(fill()) {
+		out.insert(out.end(), buf.begin(), buf.begin() + buf_len);
+	}
+	buf_pos = buf_len;
+	at_eof = true;
+}
+
 /* Reference I/O */
 
 void fasta_error(const char* fastaFname) {
@@ -16,41 +184,337 @@ void fasta_error(const char* fastaFname) {
 	exit(1);
 }
 
+// nt4 encoding of 16 characters at a time:
+// the uppercase ACGT characters differ in their low nibble (A=1, C=3, T=4, G=7),
+// each low nibble maps to a code and to the high nibble it requires, all other characters are encoded as N
+void nt4_encode(const char* in, const uint32 len, char* out) {
+	const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+	const __m128i case_mask = _mm_set1_epi8((char) 0xDF);
+	const __m128i ambig = _mm_set1_epi8(BASE_IGNORE);
+	const __m128i code_lut = _mm_setr_epi8(4, 0/*A*/, 4, 2/*C*/, 3/*T*/, 4, 4, 1/*G*/, 4, 4, 4, 4, 4, 4, 4, 4);
+	const __m128i high_lut = _mm_setr_epi8(-1, 4/*A*/, -1, 4/*C*/, 5/*T*/, -1, -1, 4/*G*/, -1, -1, -1, -1, -1, -1, -1, -1);
+	uint32 i = 0;
+	for(; i + 16 <= len; i += 16) {
+		const __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*) &in[i]), case_mask);
+		const __m128i low = _mm_and_si128(c, nibble_mask);
+		const __m128i high = _mm_and_si128(_mm_srli_epi16(c, 4), nibble_mask);
+		const __m128i is_base = _mm_cmpeq_epi8(high, _mm_shuffle_epi8(high_lut, low));
+		const __m128i code = _mm_blendv_epi8(ambig, _mm_shuffle_epi8(code_lut, low), is_base);
+		_mm_storeu_si128((__m128i*) &out[i], code);
+	}
+	for(; i < len; i++) {
+		out[i] = nt4_table[(uint8) in[i]];
+	}
+}
+
+// sequence lines of a FASTA record chunk (the chunks end at line boundaries)
+struct fasta_chunk_t {
+	uint64 start;	// file offset
+	uint64 end;
+	uint64 seq_offset;
+};
+
+// counts or encodes the sequence characters of the chunk (skipping the line breaks)
+uint64 fasta_chunk_seq(const char* data, const fasta_chunk_t& chunk, char* out) {
+	uint64 n = 0;
+	uint64 pos = chunk.start;
+	while(pos < chunk.end) {
+		const char* nl = (const char*) memchr(&data[pos], '\n', chunk.end - pos);
+		uint64 line_end = (nl == NULL) ? chunk.end : nl - data;
+		const uint64 next = (nl == NULL) ? chunk.end : line_end + 1;
+		if(line_end > pos && data[line_end - 1] == '\r') {
+			line_end--;
+		}
+		if(out != NULL) {
+			nt4_encode(&data[pos], line_end - pos, &out[n]);
+		}
+		n += line_end - pos;
+		pos = next;
+	}
+	return n;
+}
+
+#define FASTA_CHUNK_SIZE (1 << 24)
+
 // reads the sequence data from the FASTA file
+// the file is mapped, the record headers are located and the sequence lines of each record
+// are split into line-aligned chunks that are counted and encoded in parallel
+// (compressed files are inflated into memory first)
 void fasta2ref(const char *fastaFname, ref_t& ref) {
-	FILE* fastaFile = (FILE*) fopen(fastaFname, "r");
-	if (fastaFile == NULL) {
+	double start_time = omp_get_wtime();
+	seq_file_t fasta_file;
+	if(!fasta_file.open(fastaFname)) {
 		printf("fasta2ref: Cannot open FASTA file: %s!\n", fastaFname);
 		exit(1);
 	}
-	char c = (char) getc(fastaFile);
-	if(c != '>') fasta_error(fastaFname);
-	while(!feof(fastaFile)) {
-		c = (char) getc(fastaFile);
-
-		ref.subsequence_offsets.push_back(ref.seq.size());
-		// sequence description line (> ...)
-		while(c != '\n' && !feof(fastaFile)){
-			c = (char) getc(fastaFile);
+	const char* data;
+	uint64 file_size;
+	std::vector<char> inflated;
+	if(fasta_file.format == SEQ_FILE_PLAIN) {
+		struct stat st;
+		if(fstat(fasta_file.fd, &st) != 0) {
+			printf("fasta2ref: Cannot open FASTA file: %s!\n", fastaFname);
+			exit(1);
+		}
+		file_size = st.st_size;
+		if(file_size == 0) fasta_error(fastaFname);
+		data = (const char*) mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fasta_file.fd, 0);
+		if(data == MAP_FAILED) {
+			printf("fasta2ref: Cannot map FASTA file: %s!\n", fastaFname);
+			exit(1);
 		}
-		if(feof(fastaFile)) fasta_error(fastaFname);
+		madvise((void*) data, file_size, MADV_SEQUENTIAL);
+	} else {
+		fasta_file.read_all(inflated);
+		data = inflated.data();
+		file_size = inflated.size();
+		if(file_size == 0) fasta_error(fastaFname);
+	}
+	fasta_file.close();
+	if(data[0] != '>') fasta_error(fastaFname);
 
-		// sequence data
-		while(c != '>' && !feof(fastaFile)){
-			if (c != '\n'){
-				if (c >= 'a' && c <= 'z'){
-					c += 'A'-'a';
+	// 1. split the records into chunks
+	std::vector<fasta_chunk_t> chunks;
+	std::vector<uint32> record_first_chunk;
+	uint64 pos = 0;
+	while(pos < file_size) {
+		// sequence description line (> ...), the sequence name is its first word
+		const char* nl = (const char*) memchr(&data[pos], '\n', file_size - pos);
+		if(nl == NULL) fasta_error(fastaFname);
+		uint64 name_end = pos + 1;
+		while(name_end < (uint64) (nl - data) && !isspace(data[name_end])) {
+			name_end++;
+		}
+		ref.subsequence_names.push_back(std::string(&data[pos + 1], name_end - pos - 1));
+		uint64 seq_start = nl - data + 1;
+		uint64 seq_end = seq_start;
+		while(true) {
+			const char* h = (const char*) memchr(&data[seq_end], '>', file_size - seq_end);
+			if(h == NULL) {
+				seq_end = file_size;
+				break;
+			}
+			seq_end = h - data;
+			if(data[seq_end - 1] == '\n') {
+				break;
+			}
+			seq_end++;
+		}
+		record_first_chunk.push_back(chunks.size());
+		while(seq_start < seq_end) {
+			fasta_chunk_t chunk;
+			chunk.start = seq_start;
+			chunk.end = seq_end;
+			if(seq_end - seq_start > FASTA_CHUNK_SIZE) {
+				const char* line_end = (const char*) memchr(&data[seq_start + FASTA_CHUNK_SIZE], '\n', seq_end - seq_start - FASTA_CHUNK_SIZE);
+				if(line_end != NULL) {
+					chunk.end = line_end - data + 1;
 				}
-				ref.seq.append(1, nt4_table[(int) c]);
 			}
-			c = (char) getc(fastaFile);
+			chunks.push_back(chunk);
+			seq_start = chunk.end;
 		}
+		pos = seq_end;
+	}
+
+	// 2. count the sequence characters of each chunk
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(uint32 c = 0; c < chunks.size(); c++) {
+		chunks[c].seq_offset = fasta_chunk_seq(data, chunks[c], NULL);
+	}
+	uint64 seq_len = 0;
+	for(uint32 c = 0; c < chunks.size(); c++) {
+		const uint64 n = chunks[c].seq_offset;
+		chunks[c].seq_offset = seq_len;
+		seq_len += n;
+	}
+	if(seq_len > UINT_MAX) {
+		printf("fasta2ref: FASTA file %s is too long (%llu bases)!\n", fastaFname, seq_len);
+		exit(1);
+	}
+	for(uint32 r = 0; r < record_first_chunk.size(); r++) {
+		ref.subsequence_offsets.push_back(record_first_chunk[r] < chunks.size() ? chunks[record_first_chunk[r]].seq_offset : seq_len);
+	}
+
+	// 3. encode the chunks
+	ref.seq.resize(seq_len);
+	char* seq = &ref.seq[0];
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(uint32 c = 0; c < chunks.size(); c++) {
+		fasta_chunk_seq(data, chunks[c], &seq[chunks[c].seq_offset]);
+	}
+	if(inflated.size() == 0) {
+		munmap((void*) data, file_size);
 	}
 	ref.len = ref.seq.size();
+	pack_ref_seq(ref);
 	printf("Done reading FASTA file. Number of subsequences: %zu. Total sequence length read = %u\n", ref.subsequence_offsets.size(), ref.len);
-	fclose(fastaFile);
+	printf("FASTA parsing time: %.2f sec (packed reference: %.2f MB, %llu N runs)\n", omp_get_wtime() - start_time,
+			(float) ref.packed_seq.size_bytes()/(1 << 20), ref.packed_seq.n_n_runs);
+}
+
+#define PACK_SEQ_CHUNK_SIZE (1 << 20) // multiple of 32: the chunks do not share words
+
+// packs the nt4 reference sequence into 2 bits per base and the list of N runs
+void pack_ref_seq(ref_t& ref) {
+	packed_seq_t& packed = ref.packed_seq;
+	const char* seq = ref.seq.c_str();
+	packed.release();
+	packed.len = ref.len;
+	packed.words_buf.assign((ref.len + PACKED_SEQ_BASES_PER_WORD - 1)/PACKED_SEQ_BASES_PER_WORD, 0);
+	const uint32 n_chunks = (ref.len + PACK_SEQ_CHUNK_SIZE - 1)/PACK_SEQ_CHUNK_SIZE;
+	std::vector<std::vector<n_run_t>> chunk_runs(n_chunks);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(uint32 c = 0; c < n_chunks; c++) {
+		const seq_t chunk_start = c*PACK_SEQ_CHUNK_SIZE;
+		const seq_t chunk_end = std::min(chunk_start + PACK_SEQ_CHUNK_SIZE, ref.len);
+		for(seq_t i = chunk_start; i < chunk_end; i++) {
+			if(seq[i] == BASE_IGNORE) {
+				std::vector<n_run_t>& runs = chunk_runs[c];
+				if(runs.size() > 0 && runs.back().start + runs.back().len == i) {
+					runs.back().len++;
+				} else {
+					n_run_t run = {i, 1};
+					runs.push_back(run);
+				}
+			} else {
+				packed.words_buf[i / PACKED_SEQ_BASES_PER_WORD] |= (uint64) seq[i] << (2*(i % PACKED_SEQ_BASES_PER_WORD));
+			}
+		}
+	}
+	// merge the runs spanning the chunk boundaries
+	for(uint32 c = 0; c < n_chunks; c++) {
+		for(uint32 r = 0; r < chunk_runs[c].size(); r++) {
+			const n_run_t& run = chunk_runs[c][r];
+			std::vector<n_run_t>& runs = packed.n_runs_buf;
+			if(runs.size() > 0 && runs.back().start + runs.back().len == run.start) {
+				runs.back().len += run.len;
+			} else {
+				runs.push_back(run);
+			}
+		}
+	}
+	packed.attach_buffers();
+}
+
+// releases the unpacked reference sequence (the packed sequence is kept)
+void release_ref_seq(ref_t& ref) {
+	std::string().swap(ref.seq);
 }
 
+std::string ref_bin_fname(const char* fastaFname) {
+	std::string fname(fastaFname);
+	fname += std::string(".bref");
+	return fname;
+}
+
+// stores the packed reference, the sequence offsets and names in the binary reference cache
+// (the cache is tied to the size and modification time of the FASTA file)
+void store_ref_bin(const char* fastaFname, const ref_t& ref) {
+	struct stat st;
+	if(stat(fastaFname, &st) != 0) {
+		printf("store_ref_bin: Cannot open FASTA file: %s!\n", fastaFname);
+		exit(1);
+	}
+	std::string names;
+	for(uint32 i = 0; i < ref.subsequence_names.size(); i++) {
+		names += ref.subsequence_names[i];
+		names.push_back('\0');
+	}
+	const packed_seq_t& packed = ref.packed_seq;
+	ref_bin_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = REF_BIN_MAGIC;
+	header.fasta_size = st.st_size;
+	header.fasta_mtime_sec = st.st_mtim.tv_sec;
+	header.fasta_mtime_nsec = st.st_mtim.tv_nsec;
+	header.len = ref.len;
+	header.n_words = packed.n_words;
+	header.n_n_runs = packed.n_n_runs;
+	header.n_seqs = ref.subsequence_offsets.size();
+	header.names_size = names.size();
+	header.words_start = ref_idx_align(sizeof(header));
+	header.n_runs_start = ref_idx_align(header.words_start + header.n_words*sizeof(uint64));
+	header.offsets_start = header.n_runs_start + header.n_n_runs*sizeof(n_run_t);
+	header.names_start = header.offsets_start + header.n_seqs*sizeof(uint32);
+	header.file_size = header.names_start + header.names_size;
+
+	std::string fname = ref_bin_fname(fastaFname);
+	std::ofstream file;
+	file.open(fname.c_str(), std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		printf("store_ref_bin: Cannot open the reference cache file %s!\n", fname.c_str());
+		exit(1);
+	}
+	std::vector<char> padding(REF_IDX_ALIGNMENT, 0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(&padding[0], header.words_start - sizeof(header));
+	file.write(reinterpret_cast<const char*>(packed.words), header.n_words*sizeof(uint64));
+	file.write(&padding[0], header.n_runs_start - (header.words_start + header.n_words*sizeof(uint64)));
+	file.write(reinterpret_cast<const char*>(packed.n_runs), header.n_n_runs*sizeof(n_run_t));
+	file.write(reinterpret_cast<const char*>(ref.subsequence_offsets.data()), header.n_seqs*sizeof(uint32));
+	file.write(names.data(), names.size());
+	file.close();
+}
+
+// maps the packed reference from the binary reference cache
+// returns false if the cache is missing or does not match the FASTA file
+bool load_ref_bin(const char* fastaFname, ref_t& ref) {
+	std::string fname = ref_bin_fname(fastaFname);
+	struct stat fasta_st;
+	struct stat st;
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	ref_bin_header_t header;
+	if(stat(fastaFname, &fasta_st) != 0 || fstat(fd, &st) != 0 ||
+			pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != REF_BIN_MAGIC ||
+			header.fasta_size != (uint64) fasta_st.st_size || header.fasta_mtime_sec != (uint64) fasta_st.st_mtim.tv_sec ||
+			header.fasta_mtime_nsec != (uint64) fasta_st.st_mtim.tv_nsec || header.file_size != (uint64) st.st_size) {
+		printf("load_ref_bin: Reference cache %s is missing or out of date \n", fname.c_str());
+		close(fd);
+		return false;
+	}
+	void* addr = mmap(NULL, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("load_ref_bin: Cannot map the reference cache file %s!\n", fname.c_str());
+		exit(1);
+	}
+	const char* data = (const char*) addr;
+	packed_seq_t& packed = ref.packed_seq;
+	packed.release();
+	packed.mmap_addr = addr;
+	packed.mmap_len = header.file_size;
+	packed.words = reinterpret_cast<const uint64*>(data + header.words_start);
+	packed.n_words = header.n_words;
+	packed.n_runs = reinterpret_cast<const n_run_t*>(data + header.n_runs_start);
+	packed.n_n_runs = header.n_n_runs;
+	packed.len = header.len;
+	ref.len = header.len;
+	const uint32* offsets = reinterpret_cast<const uint32*>(data + header.offsets_start);
+	ref.subsequence_offsets.assign(offsets, offsets + header.n_seqs);
+	ref.subsequence_names.clear();
+	const char* name = data + header.names_start;
+	for(uint64 i = 0; i < header.n_seqs; i++) {
+		ref.subsequence_names.push_back(std::string(name));
+		name += ref.subsequence_names.back().size() + 1;
+	}
+	printf("Loaded the packed reference from %s. Number of subsequences: %zu. Total sequence length = %u\n",
+			fname.c_str(), ref.subsequence_offsets.size(), ref.len);
+	return true;
+}
+
+// loads the packed reference from the binary cache, or parses the FASTA file if the cache is not valid
+void load_packed_ref(const char* fastaFname, ref_t& ref) {
+	if(!load_ref_bin(fastaFname, ref)) {
+		fasta2ref(fastaFname, ref);
+		release_ref_seq(ref);
+	}
+}
+
+// the window mask is stored as a header followed by a packed bitset (one bit per window)
 void store_valid_window_mask(const char* refFname, const ref_t& ref, const index_params_t* params) {
 	std::string fname(refFname);
 	fname += std::string(".window_mask.");
@@ -63,37 +527,65 @@ void store_valid_window_mask(const char* refFname, const ref_t& ref, const index
 		printf("store_valid_window_mask: Cannot open the mask file %s!\n", fname.c_str());
 		exit(1);
 	}
-	for (uint32 i = 0; i < ref.ignore_window_bitmask.size(); i++) {
+	const uint64 n_windows = ref.ignore_window_bitmask.size();
+	std::vector<uint64> words((n_windows + 63)/64);
+	for (uint64 i = 0; i < n_windows; i++) {
 		if(ref.ignore_window_bitmask[i]) {
-			char b = '1';
-			file.write(reinterpret_cast<char*>(&b), sizeof(char));
-		} else {
-			char b = '0';
-			file.write(reinterpret_cast<char*>(&b), sizeof(char));
+			words[i >> 6] |= 1ULL << (i & 63);
 		}
-
 	}
+	uint64 header[2] = {WINDOW_MASK_MAGIC, n_windows};
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(words.data()), words.size()*sizeof(uint64));
 	file.close();
 }
 
+// loads the packed window mask or the legacy mask (one '0'/'1' character per window)
+// returns false if the file is missing or does not match the reference
 bool load_valid_window_mask(const char* refFname, ref_t& ref, const index_params_t* params) {
 	std::string fname(refFname);
 	fname += std::string(".window_mask.");
 	fname += std::to_string(params->ref_window_size);
 
 	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
+	file.open(fname.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
 
 	if (!file.is_open()) {
 		printf("load_valid_window_mask: Could not open the mask file %s!\n", fname.c_str());
 		return false;
 	}
-	char b;
-	ref.ignore_window_bitmask.resize(ref.len - params->ref_window_size + 1);
-	for(seq_t pos = 0; pos < ref.len - params->ref_window_size + 1; pos++) {
-		file.read(reinterpret_cast<char*>(&b), sizeof(char));
-		if(b == '1') {
-			ref.ignore_window_bitmask[pos] = 1;
+	const uint64 file_size = file.tellg();
+	file.seekg(0);
+	const uint64 n_windows = ref.len - params->ref_window_size + 1;
+	ref.ignore_window_bitmask.assign(n_windows, false);
+
+	uint64 header[2] = {0, 0};
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if(file && header[0] == WINDOW_MASK_MAGIC) {
+		std::vector<uint64> words((n_windows + 63)/64);
+		if(header[1] != n_windows || file_size != sizeof(header) + words.size()*sizeof(uint64)) {
+			printf("load_valid_window_mask: Mask file %s does not match the reference!\n", fname.c_str());
+			return false;
+		}
+		file.read(reinterpret_cast<char*>(words.data()), words.size()*sizeof(uint64));
+		for(uint64 w = 0; w < words.size(); w++) {
+			for(uint64 bits = words[w]; bits != 0; bits &= bits - 1) {
+				ref.ignore_window_bitmask[w*64 + __builtin_ctzll(bits)] = 1;
+			}
+		}
+	} else {
+		if(file_size != n_windows) {
+			printf("load_valid_window_mask: Mask file %s does not match the reference!\n", fname.c_str());
+			return false;
+		}
+		file.clear();
+		file.seekg(0);
+		std::vector<char> chars(n_windows);
+		file.read(chars.data(), n_windows);
+		for(uint64 pos = 0; pos < n_windows; pos++) {
+			if(chars[pos] == '1') {
+				ref.ignore_window_bitmask[pos] = 1;
+			}
 		}
 	}
 	file.close();
@@ -141,24 +633,37 @@ bool load_repeat_local(const char* refFname, ref_t& ref, const index_params_t* p
         return true;
 }
 
+#define KMER2_HASH_CHUNK_SIZE (1 << 16)
+
+// the kmers are hashed from the packed reference, unpacked one chunk at a time
 void compute_store_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params) {
-	ref.precomputed_kmer2_hashes.resize(ref.len - params->k2 + 1);
-	#pragma omp parallel for
-	for (seq_t pos = 0; pos < ref.len - params->k2 + 1; pos++) {
-		switch(params->kmer_hashing_alg) {
-			case SHA1_E:
-				uint32_t hash[5];
-				sha1_hash(reinterpret_cast<const uint8_t*>(&ref.seq[pos]), params->k2, hash);
-				ref.precomputed_kmer2_hashes[pos] = ((uint64) hash[0] << 32 | hash[1]);
-				break;
-			case CITY_HASH64:
-				ref.precomputed_kmer2_hashes[pos] = CityHash64(&ref.seq[pos], params->k2);
-				break;
-			case PACK64:
-				pack_64(&ref.seq[pos], params->k2, &ref.precomputed_kmer2_hashes[pos]);
-				break;
+	const seq_t n_kmers = ref.len - params->k2 + 1;
+	ref.precomputed_kmer2_hashes.resize(n_kmers);
+	#pragma omp parallel
+	{
+	std::vector<char> chunk_seq(KMER2_HASH_CHUNK_SIZE + params->k2);
+	#pragma omp for schedule(dynamic, 1)
+	for (seq_t chunk_start = 0; chunk_start < n_kmers; chunk_start += KMER2_HASH_CHUNK_SIZE) {
+		const seq_t chunk_end = std::min(chunk_start + KMER2_HASH_CHUNK_SIZE, n_kmers);
+		ref.packed_seq.unpack(chunk_start, chunk_end - chunk_start + params->k2 - 1, chunk_seq.data());
+		for (seq_t pos = chunk_start; pos < chunk_end; pos++) {
+			const char* kmer = &chunk_seq[pos - chunk_start];
+			switch(params->kmer_hashing_alg) {
+				case SHA1_E:
+					uint32_t hash[5];
+					sha1_hash(reinterpret_cast<const uint8_t*>(kmer), params->k2, hash);
+					ref.precomputed_kmer2_hashes[pos] = ((uint64) hash[0] << 32 | hash[1]);
+					break;
+				case CITY_HASH64:
+					ref.precomputed_kmer2_hashes[pos] = CityHash64(kmer, params->k2);
+					break;
+				case PACK64:
+					pack_64(kmer, params->k2, &ref.precomputed_kmer2_hashes[pos]);
+					break;
+			}
 		}
 	}
+	}
 	std::string fname(refFname);
 	fname += std::string(".hash.");
 	fname += std::to_string(params->k2);
@@ -255,41 +760,9 @@ bool load_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* p
 	return true;
 }
 
-void store_ref_idx_flat(const char* refFname, const ref_t& ref, const index_params_t* params) {
+std::string ref_idx_fname(const char* refFname, const index_params_t* params) {
 	std::string fname(refFname);
-	fname += std::string(".idx_flat.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-    fname += std::to_string(params->n_buckets_pow2);
-    fname += std::string("_k");
-    fname += std::to_string(params->k);
-    fname += std::string("_H");
-    fname += std::to_string(params->max_count);
-
-	std::ofstream file;
-	file.open(fname.c_str(), std::ios::out | std::ios::binary);
-	if (!file.is_open()) {
-		printf("store_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		exit(1);
-	}
-
-	uint64 total_num_entries = ref.index.buckets_data.size();
-	file.write(reinterpret_cast<char*>(&total_num_entries), sizeof(total_num_entries));
-	file.write(reinterpret_cast<const char*>(&ref.index.buckets_data[0]), total_num_entries*sizeof(loc_t));
-	file.write(reinterpret_cast<const char*>(&ref.index.bucket_offsets[0]), (params->n_tables*params->n_buckets+1)*sizeof(uint64));
-	file.close();
-}
-
-void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx_flat.");
+	fname += std::string(".idx.");
 	fname += std::string("h");
 	fname += std::to_string(params->h);
 	fname += std::string("_T");
@@ -304,43 +777,109 @@ void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* p
 	fname += std::to_string(params->k);
 	fname += std::string("_H");
 	fname += std::to_string(params->max_count);
+	if(params->alg == OPH) {
+		fname += std::string("_oph");
+	}
+	return fname;
+}
 
-	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
-		printf("load_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		std::cerr << "Error: " << strerror(errno);
-		exit(1);
+// checksum of a large array: the blocks are hashed in parallel and the block hashes are hashed together
+#define REF_IDX_CHECKSUM_BLOCK_SIZE (1ULL << 26)
+uint64 ref_idx_checksum(const char* data, const uint64 len, const uint64 seed) {
+	const uint64 n_blocks = (len + REF_IDX_CHECKSUM_BLOCK_SIZE - 1) / REF_IDX_CHECKSUM_BLOCK_SIZE;
+	std::vector<uint64> block_hashes(n_blocks);
+	#pragma omp parallel for
+	for(uint64 b = 0; b < n_blocks; b++) {
+		const uint64 block_len = std::min(REF_IDX_CHECKSUM_BLOCK_SIZE, len - b*REF_IDX_CHECKSUM_BLOCK_SIZE);
+		block_hashes[b] = CityHash64WithSeed(data + b*REF_IDX_CHECKSUM_BLOCK_SIZE, block_len, seed);
 	}
+	return CityHash64WithSeed(reinterpret_cast<const char*>(block_hashes.data()), n_blocks*sizeof(uint64), seed);
+}
 
-	uint64 total_num_bucket_entries;
-	file.read(reinterpret_cast<char*>(&total_num_bucket_entries), sizeof(total_num_bucket_entries));
-	ref.index.bucket_offsets.resize(params->n_tables*params->n_buckets+1);
-	ref.index.buckets_data.resize(total_num_bucket_entries);
-	file.read(reinterpret_cast<char*>(&ref.index.buckets_data[0]), total_num_bucket_entries*sizeof(loc_t));
-	file.read(reinterpret_cast<char*>(&ref.index.bucket_offsets[0]), (params->n_tables*params->n_buckets+1)*sizeof(uint64));
-	file.close();
+// checksum of the packed reference sequence and its N runs
+uint64 ref_seq_checksum(const ref_t& ref) {
+	const packed_seq_t& packed = ref.packed_seq;
+	const uint64 runs_checksum = ref_idx_checksum(reinterpret_cast<const char*>(packed.n_runs), packed.n_n_runs*sizeof(n_run_t), 0);
+	return ref_idx_checksum(reinterpret_cast<const char*>(packed.words), packed.n_words*sizeof(uint64), runs_checksum);
+}
+
+uint64 ref_idx_data_checksum(const static_index_t& index) {
+	uint64 c = ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_offsets), index.n_bucket_offsets*sizeof(uint64), 0);
+	if(index.layout == IDX_LAYOUT_PACKED) {
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_byte_offsets), index.n_bucket_offsets*sizeof(uint64), c);
+		return ref_idx_checksum(reinterpret_cast<const char*>(index.packed_data), index.n_packed_bytes, c);
+	}
+	if(index.layout == IDX_LAYOUT_SOA) {
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_hashes), index.n_entries*sizeof(minhash_t), c);
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_pos), index.n_entries*sizeof(seq_t), c);
+		return ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_lens), index.n_entries*sizeof(len_t), c);
+	}
+	c = ref_idx_checksum(reinterpret_cast<const char*>(index.buckets_data), index.n_entries*sizeof(loc_t), c);
+	if(index.bucket_dir_offsets != NULL) {
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.bucket_dir_offsets), index.n_bucket_offsets*sizeof(uint64), c);
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.dir_hashes), index.n_dir_entries*sizeof(minhash_t), c);
+		c = ref_idx_checksum(reinterpret_cast<const char*>(index.dir_starts), index.n_dir_entries*sizeof(uint32), c);
+	}
+	return c;
+}
+
+uint64 ref_idx_header_checksum(const ref_idx_header_t& header, const std::vector<char>& hash_state) {
+	ref_idx_header_t h = header;
+	h.header_checksum = 0;
+	uint64 c = CityHash64(reinterpret_cast<const char*>(&h), sizeof(h));
+	return CityHash64WithSeed(hash_state.data(), hash_state.size(), c);
+}
+
+template<typename T>
+void append_hash_state(std::vector<char>& buf, const T* src, const uint64 n) {
+	buf.insert(buf.end(), reinterpret_cast<const char*>(src), reinterpret_cast<const char*>(src + n));
+}
+
+template<typename T>
+bool read_hash_state(const std::vector<char>& buf, uint64& offset, T* dst, const uint64 n) {
+	if(offset + n*sizeof(T) > buf.size()) return false;
+	memcpy(dst, &buf[offset], n*sizeof(T));
+	offset += n*sizeof(T);
+	return true;
+}
+
+// serializes the min-hash functions, the sketch projection hash function and the sketch projection indices
+void serialize_hash_state(const index_params_t* params, std::vector<char>& buf) {
+	buf.clear();
+	for(uint32 f = 0; f < params->h; f++) {
+		append_hash_state(buf, &params->minhash_functions[f].a, 1);
+		append_hash_state(buf, &params->minhash_functions[f].M, 1);
+	}
+	const rand_hash_function_t& proj = params->sketch_proj_hash_func;
+	const uint32 vec_len = proj.a_vec.size();
+	append_hash_state(buf, &proj.M, 1);
+	append_hash_state(buf, &vec_len, 1);
+	append_hash_state(buf, proj.a_vec.data(), vec_len);
+	append_hash_state(buf, params->sketch_proj_indices.data(), params->sketch_proj_indices.size());
+}
+
+bool deserialize_hash_state(const std::vector<char>& buf, index_params_t* params) {
+	uint64 offset = 0;
+	params->minhash_functions.resize(params->h);
+	for(uint32 f = 0; f < params->h; f++) {
+		if(!read_hash_state(buf, offset, &params->minhash_functions[f].a, 1)) return false;
+		if(!read_hash_state(buf, offset, &params->minhash_functions[f].M, 1)) return false;
+	}
+	rand_hash_function_t& proj = params->sketch_proj_hash_func;
+	uint32 vec_len;
+	if(!read_hash_state(buf, offset, &proj.M, 1)) return false;
+	if(!read_hash_state(buf, offset, &vec_len, 1) || vec_len != params->sketch_proj_len) return false;
+	proj.a = 0;
+	proj.a_vec.resize(vec_len);
+	if(!read_hash_state(buf, offset, proj.a_vec.data(), vec_len)) return false;
+	params->sketch_proj_indices.resize(params->n_tables*params->sketch_proj_len);
+	if(!read_hash_state(buf, offset, params->sketch_proj_indices.data(), params->sketch_proj_indices.size())) return false;
+	return offset == buf.size();
 }
 
 // store the reference index
 void store_ref_idx(const char* refFname, const ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-    fname += std::to_string(params->n_buckets_pow2);
-    fname += std::string("_k");
-    fname += std::to_string(params->k);
-    fname += std::string("_H");
-    fname += std::to_string(params->max_count);
-
+	std::string fname = params->out_index_fname.size() != 0 ? params->out_index_fname : ref_idx_fname(refFname, params);
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
@@ -348,139 +887,252 @@ void store_ref_idx(const char* refFname, const ref_t& ref, const index_params_t*
 		exit(1);
 	}
 
-	uint64 total_num_entries = 0;
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		total_num_entries += ref.mutable_index.per_table_buckets[i].n_entries;
+	std::vector<char> hash_state;
+	serialize_hash_state(params, hash_state);
+
+	ref_idx_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = REF_IDX_MAGIC;
+	header.flags = ref.index.sorted ? REF_IDX_FLAG_SORTED : 0;
+	header.alg = params->alg;
+	header.k = params->k;
+	header.h = params->h;
+	header.n_tables = params->n_tables;
+	header.sketch_proj_len = params->sketch_proj_len;
+	header.n_buckets_pow2 = params->n_buckets_pow2;
+	header.ref_window_size = params->ref_window_size;
+	header.max_count = params->max_count;
+	header.build_time = time(NULL);
+	header.ref_len = ref.len;
+	header.n_ref_seqs = ref.subsequence_offsets.size();
+	header.ref_seq_checksum = ref_seq_checksum(ref);
+	header.hash_state_start = sizeof(header);
+	header.hash_state_size = hash_state.size();
+	header.n_bucket_offsets = ref.index.n_bucket_offsets;
+	header.n_entries = ref.index.n_entries;
+	header.layout = ref.index.layout;
+	header.bucket_offsets_start = ref_idx_align(header.hash_state_start + header.hash_state_size);
+	if(ref.index.layout == IDX_LAYOUT_PACKED) {
+		header.n_packed_bytes = ref.index.n_packed_bytes;
+		header.packed_pos_bytes = ref.index.packed_pos_bytes;
+		header.bucket_byte_offsets_start = ref_idx_align(header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64));
+		header.packed_data_start = ref_idx_align(header.bucket_byte_offsets_start + header.n_bucket_offsets*sizeof(uint64));
+		header.file_size = header.packed_data_start + header.n_packed_bytes;
+	} else if(ref.index.layout == IDX_LAYOUT_SOA) {
+		header.bucket_hashes_start = ref_idx_align(header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64));
+		header.bucket_pos_start = ref_idx_align(header.bucket_hashes_start + header.n_entries*sizeof(minhash_t));
+		header.bucket_lens_start = ref_idx_align(header.bucket_pos_start + header.n_entries*sizeof(seq_t));
+		header.file_size = header.bucket_lens_start + header.n_entries*sizeof(len_t);
+	} else {
+		header.buckets_data_start = ref_idx_align(header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64));
+		header.file_size = header.buckets_data_start + header.n_entries*sizeof(loc_t);
+		if(ref.index.bucket_dir_offsets != NULL) {
+			header.n_dir_entries = ref.index.n_dir_entries;
+			header.bucket_dir_offsets_start = ref_idx_align(header.file_size);
+			header.dir_hashes_start = ref_idx_align(header.bucket_dir_offsets_start + header.n_bucket_offsets*sizeof(uint64));
+			header.dir_starts_start = ref_idx_align(header.dir_hashes_start + header.n_dir_entries*sizeof(minhash_t));
+			header.file_size = header.dir_starts_start + header.n_dir_entries*sizeof(uint32);
+		}
 	}
-	file.write(reinterpret_cast<char*>(&total_num_entries), sizeof(total_num_entries));
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		const buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
-		for(uint32 j = 0; j < params->n_buckets; j++) {
-			const VectorSeqPos& bucket = buckets.buckets_data_vectors[j];
-			uint32 size = bucket.size();
-			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
-			file.write(reinterpret_cast<const char*>(&bucket[0]), size*sizeof(loc_t));
+	header.data_checksum = ref_idx_data_checksum(ref.index);
+	header.header_checksum = ref_idx_header_checksum(header, hash_state);
+
+	std::vector<char> padding(REF_IDX_ALIGNMENT, 0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(hash_state.data(), hash_state.size());
+	file.write(&padding[0], header.bucket_offsets_start - (header.hash_state_start + header.hash_state_size));
+	file.write(reinterpret_cast<const char*>(ref.index.bucket_offsets), header.n_bucket_offsets*sizeof(uint64));
+	if(ref.index.layout == IDX_LAYOUT_PACKED) {
+		file.write(&padding[0], header.bucket_byte_offsets_start - (header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64)));
+		file.write(reinterpret_cast<const char*>(ref.index.bucket_byte_offsets), header.n_bucket_offsets*sizeof(uint64));
+		file.write(&padding[0], header.packed_data_start - (header.bucket_byte_offsets_start + header.n_bucket_offsets*sizeof(uint64)));
+		file.write(reinterpret_cast<const char*>(ref.index.packed_data), header.n_packed_bytes);
+	} else if(ref.index.layout == IDX_LAYOUT_SOA) {
+		file.write(&padding[0], header.bucket_hashes_start - (header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64)));
+		file.write(reinterpret_cast<const char*>(ref.index.bucket_hashes), header.n_entries*sizeof(minhash_t));
+		file.write(&padding[0], header.bucket_pos_start - (header.bucket_hashes_start + header.n_entries*sizeof(minhash_t)));
+		file.write(reinterpret_cast<const char*>(ref.index.bucket_pos), header.n_entries*sizeof(seq_t));
+		file.write(&padding[0], header.bucket_lens_start - (header.bucket_pos_start + header.n_entries*sizeof(seq_t)));
+		file.write(reinterpret_cast<const char*>(ref.index.bucket_lens), header.n_entries*sizeof(len_t));
+	} else {
+		file.write(&padding[0], header.buckets_data_start - (header.bucket_offsets_start + header.n_bucket_offsets*sizeof(uint64)));
+		file.write(reinterpret_cast<const char*>(ref.index.buckets_data), header.n_entries*sizeof(loc_t));
+		if(ref.index.bucket_dir_offsets != NULL) {
+			file.write(&padding[0], header.bucket_dir_offsets_start - (header.buckets_data_start + header.n_entries*sizeof(loc_t)));
+			file.write(reinterpret_cast<const char*>(ref.index.bucket_dir_offsets), header.n_bucket_offsets*sizeof(uint64));
+			file.write(&padding[0], header.dir_hashes_start - (header.bucket_dir_offsets_start + header.n_bucket_offsets*sizeof(uint64)));
+			file.write(reinterpret_cast<const char*>(ref.index.dir_hashes), header.n_dir_entries*sizeof(minhash_t));
+			file.write(&padding[0], header.dir_starts_start - (header.dir_hashes_start + header.n_dir_entries*sizeof(minhash_t)));
+			file.write(reinterpret_cast<const char*>(ref.index.dir_starts), header.n_dir_entries*sizeof(uint32));
 		}
 	}
 	file.close();
 }
 
-// load the reference index buckets
-void load_ref_idx(const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx.");
-	fname += std::string("h");
-	fname += std::to_string(params->h);
-	fname += std::string("_T");
-	fname += std::to_string(params->n_tables);
-	fname += std::string("_b");
-	fname += std::to_string(params->sketch_proj_len);
-	fname += std::string("_w");
-	fname += std::to_string(params->ref_window_size);
-	fname += std::string("_p");
-	fname += std::to_string(params->n_buckets_pow2);
-	fname += std::string("_k");
-	fname += std::to_string(params->k);
-	fname += std::string("_H");
-	fname += std::to_string(params->max_count);
+// reads and validates the index file header and hash state
+// (the files written before the kmers were hashed on their packed encoding are rejected)
+void read_ref_idx_header(const int fd, const std::string& fname, ref_idx_header_t& header, std::vector<char>& hash_state) {
+	memset(&header, 0, sizeof(header));
+	if(pread(fd, &header.magic, sizeof(header.magic), 0) != sizeof(header.magic) || header.magic != REF_IDX_MAGIC) {
+		printf("load_ref_idx: IDX file %s was written in an unsupported format version, please rebuild the index!\n", fname.c_str());
+		exit(1);
+	}
+	if(pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		printf("load_ref_idx: IDX file %s is truncated!\n", fname.c_str());
+		exit(1);
+	}
+	// the header is not verified yet: bound the hash state by the file size before allocating it
+	struct stat st;
+	if(fstat(fd, &st) != 0 || header.hash_state_start > (uint64) st.st_size ||
+			header.hash_state_size > (uint64) st.st_size - header.hash_state_start) {
+		printf("load_ref_idx: IDX file %s header is corrupted (checksum mismatch)!\n", fname.c_str());
+		exit(1);
+	}
+	hash_state.resize(header.hash_state_size);
+	if(pread(fd, hash_state.data(), header.hash_state_size, header.hash_state_start) != (ssize_t) header.hash_state_size ||
+			ref_idx_header_checksum(header, hash_state) != header.header_checksum) {
+		printf("load_ref_idx: IDX file %s header is corrupted (checksum mismatch)!\n", fname.c_str());
+		exit(1);
+	}
+}
 
-	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
+// loads the index parameters and hash functions from the index file header
+// returns false if the index file does not exist
+bool load_ref_idx_params(const char* refFname, index_params_t* params) {
+	std::string fname = params->in_index_fname.size() != 0 ? params->in_index_fname : ref_idx_fname(refFname, params);
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if(params->in_index_fname.size() != 0) {
+			printf("load_ref_idx_params: Cannot open the IDX file %s!\n", fname.c_str());
+			std::cerr << "Error: " << strerror(errno);
+			exit(1);
+		}
+		return false;
+	}
+	ref_idx_header_t header;
+	std::vector<char> hash_state;
+	read_ref_idx_header(fd, fname, header, hash_state);
+	close(fd);
+
+	params->alg = (algorithm) header.alg;
+	params->k = header.k;
+	params->h = header.h;
+	params->n_tables = header.n_tables;
+	params->sketch_proj_len = header.sketch_proj_len;
+	params->n_buckets_pow2 = header.n_buckets_pow2;
+	params->n_buckets = 1 << header.n_buckets_pow2;
+	params->ref_window_size = header.ref_window_size;
+	params->max_count = header.max_count;
+	params->layout = (idx_layout) header.layout;
+	if(!deserialize_hash_state(hash_state, params)) {
+		printf("load_ref_idx_params: IDX file %s stores an invalid hash state!\n", fname.c_str());
+		exit(1);
+	}
+	if(params->in_index_fname.size() == 0) {
+		params->in_index_fname = fname;
+	}
+	printf("Index parameters loaded from %s: h=%u T=%u b=%u p=%u w=%u k=%u H=%llu \n", fname.c_str(),
+			params->h, params->n_tables, params->sketch_proj_len, params->n_buckets_pow2, params->ref_window_size, params->k, params->max_count);
+	return true;
+}
+
+// map the reference index file and use the bucket arrays in place
+void load_ref_idx(const char* refFname, ref_t& ref, const index_params_t* params) {
+	std::string fname = params->in_index_fname.size() != 0 ? params->in_index_fname : ref_idx_fname(refFname, params);
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0) {
 		printf("load_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
 		std::cerr << "Error: " << strerror(errno);
 		exit(1);
 	}
 
-	uint64 total_num_bucket_entries;
-	file.read(reinterpret_cast<char*>(&total_num_bucket_entries), sizeof(total_num_bucket_entries));
-	ref.index.bucket_offsets.resize(params->n_tables*params->n_buckets+1);
-	ref.index.buckets_data.resize(total_num_bucket_entries);
-	std::cout << "Total number of contig entries in the index: " << total_num_bucket_entries << "\n";
+	ref_idx_header_t header;
+	std::vector<char> hash_state;
+	read_ref_idx_header(fd, fname, header, hash_state);
 
-	uint64 bucket_idx = 0;
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		for(uint32 j = 0; j < params->n_buckets; j++) {
-			ref.index.bucket_offsets[i*params->n_buckets + j] = bucket_idx;
-			uint32 size;
-			file.read(reinterpret_cast<char*>(&size), sizeof(size));
-			file.read(reinterpret_cast<char*>(&ref.index.buckets_data[bucket_idx]), size*sizeof(loc_t));
-			std::sort(ref.index.buckets_data.begin() + bucket_idx, ref.index.buckets_data.begin() + bucket_idx + size, comp_loc());
-			bucket_idx += size;
-		}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (uint64) st.st_size != header.file_size) {
+		printf("load_ref_idx: IDX file %s is truncated (expected %llu bytes)!\n", fname.c_str(), header.file_size);
+		exit(1);
+	}
+	std::vector<char> params_hash_state;
+	serialize_hash_state(params, params_hash_state);
+	if(header.h != params->h || header.n_tables != params->n_tables || header.sketch_proj_len != params->sketch_proj_len ||
+			header.n_buckets_pow2 != params->n_buckets_pow2 || header.ref_window_size != params->ref_window_size ||
+			header.k != params->k || header.max_count != params->max_count || header.alg != (uint32) params->alg ||
+			header.n_bucket_offsets != (uint64) params->n_tables*params->n_buckets+1 || hash_state != params_hash_state) {
+		printf("load_ref_idx: IDX file %s was built with different index parameters!\n", fname.c_str());
+		exit(1);
+	}
+	if(header.ref_len != ref.len || header.n_ref_seqs != ref.subsequence_offsets.size() ||
+			(params->verify_index && header.ref_seq_checksum != ref_seq_checksum(ref))) {
+		printf("load_ref_idx: IDX file %s was built for a different reference!\n", fname.c_str());
+		exit(1);
 	}
-	ref.index.bucket_offsets[ref.index.bucket_offsets.size()-1] = bucket_idx;
-	file.close();
-}
-
-void store_ref_idx_per_thread(const int tid, const bool first_entry, const char* refFname, ref_t& ref, const index_params_t* params) {
-	std::string fname(refFname);
-	fname += std::string(".idx_tid");
-	fname += std::to_string(tid);
 
-	std::ofstream file;
-	if(first_entry) {
-		file.open(fname.c_str(), std::ios::out | std::ios::binary);
-	} else {
-		file.open(fname.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+	int mmap_flags = MAP_SHARED;
+	if(params->idx_prefetch == IDX_PREFETCH_POPULATE) {
+		mmap_flags |= MAP_POPULATE;
 	}
-	if (!file.is_open()) {
-		printf("store_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
+	void* addr = mmap(NULL, header.file_size, PROT_READ, mmap_flags, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("load_ref_idx: Cannot map the IDX file %s!\n", fname.c_str());
+		std::cerr << "Error: " << strerror(errno);
 		exit(1);
 	}
+	if(params->idx_prefetch == IDX_PREFETCH_WILLNEED) {
+		madvise(addr, header.file_size, MADV_WILLNEED);
+	}
 
-	for(uint32 i = 0; i < params->n_tables; i++) {
-		buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
-		for(uint32 j = 0; j < params->n_buckets; j++) {
-			VectorSeqPos& bucket = buckets.per_thread_buckets_data_vectors[tid][j];
-			uint32 size = buckets.per_thread_bucket_sizes[tid][j];
-			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
-			for(uint32 k = 0; k < size; k++) {
-				file.write(reinterpret_cast<const char*>(&bucket[k].pos), sizeof(seq_t));
-				file.write(reinterpret_cast<const char*>(&bucket[k].len), sizeof(len_t));
-				file.write(reinterpret_cast<const char*>(&bucket[k].hash), sizeof(minhash_t));
-			}
-			bucket.resize(0);
-			bucket.shrink_to_fit();
+	ref.index.release();
+	ref.index.mmap_addr = addr;
+	ref.index.mmap_len = header.file_size;
+	ref.index.layout = (idx_layout) header.layout;
+	ref.index.bucket_offsets = reinterpret_cast<const uint64*>((const char*) addr + header.bucket_offsets_start);
+	if(ref.index.layout == IDX_LAYOUT_PACKED) {
+		ref.index.bucket_byte_offsets = reinterpret_cast<const uint64*>((const char*) addr + header.bucket_byte_offsets_start);
+		ref.index.packed_data = reinterpret_cast<const uint8*>(addr) + header.packed_data_start;
+		ref.index.n_packed_bytes = header.n_packed_bytes;
+		ref.index.packed_pos_bytes = header.packed_pos_bytes;
+	} else if(ref.index.layout == IDX_LAYOUT_SOA) {
+		ref.index.bucket_hashes = reinterpret_cast<const minhash_t*>((const char*) addr + header.bucket_hashes_start);
+		ref.index.bucket_pos = reinterpret_cast<const seq_t*>((const char*) addr + header.bucket_pos_start);
+		ref.index.bucket_lens = reinterpret_cast<const len_t*>((const char*) addr + header.bucket_lens_start);
+	} else {
+		ref.index.buckets_data = reinterpret_cast<const loc_t*>((const char*) addr + header.buckets_data_start);
+		if(header.bucket_dir_offsets_start != 0) {
+			ref.index.bucket_dir_offsets = reinterpret_cast<const uint64*>((const char*) addr + header.bucket_dir_offsets_start);
+			ref.index.dir_hashes = reinterpret_cast<const minhash_t*>((const char*) addr + header.dir_hashes_start);
+			ref.index.dir_starts = reinterpret_cast<const uint32*>((const char*) addr + header.dir_starts_start);
+			ref.index.n_dir_entries = header.n_dir_entries;
 		}
-		std::fill(buckets.per_thread_bucket_sizes[tid].begin(), buckets.per_thread_bucket_sizes[tid].end(), 0);
 	}
-	file.close();
-}
-
-void load_ref_idx_per_thread(const int tid, const int nloads, const char* refFname, ref_t& ref, index_params_t* params) {
-	if(nloads == 0) return;
-
-	std::string fname(refFname);
-	fname += std::string(".idx_tid");
-	fname += std::to_string(tid);
+	ref.index.n_bucket_offsets = header.n_bucket_offsets;
+	ref.index.n_entries = header.n_entries;
+	std::cout << "Total number of contig entries in the index: " << header.n_entries << "\n";
+	if(ref.index.layout == IDX_LAYOUT_PACKED) {
+		printf("Packed index entries: %llu bytes (%.2f bytes per entry) \n", header.n_packed_bytes, (double) header.n_packed_bytes / std::max(header.n_entries, 1ULL));
+	}
 
-	std::ifstream file;
-	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
-		printf("load_ref_idx: Cannot open the IDX file %s!\n", fname.c_str());
-		std::cerr << "Error: " << strerror(errno) << "\n";
+	if(params->verify_index && ref_idx_data_checksum(ref.index) != header.data_checksum) {
+		printf("load_ref_idx: IDX file %s is corrupted (checksum mismatch)!\n", fname.c_str());
 		exit(1);
 	}
 
-	for(int l = 0; l < nloads; l++) {
-		for(uint32 i = 0; i < params->n_tables; i++) {
-			buckets_t* buckets = &ref.mutable_index.per_table_buckets[i];
-			for(uint32 b = 0; b < params->n_buckets; b++) {
-				VectorSeqPos& global_bucket = buckets->buckets_data_vectors[b];
-				uint32 size;
-				file.read(reinterpret_cast<char*>(&size), sizeof(size));
-				for(uint32 k = 0; k < size; k++) {
-					loc_t w;
-					file.read(reinterpret_cast<char*>(&w.pos), sizeof(seq_t));
-					file.read(reinterpret_cast<char*>(&w.len), sizeof(len_t));
-					file.read(reinterpret_cast<char*>(&w.hash), sizeof(minhash_t));
-					global_bucket.push_back(w);
-				}
-			}
-		}
+	if(header.flags & REF_IDX_FLAG_SORTED) {
+		ref.index.sorted = true;
+	} else {
+		// the mapping is read-only: sort a private copy (packed and SoA indexes are always sorted)
+		printf("load_ref_idx: Index buckets are not marked as sorted, sorting... \n");
+		std::vector<uint64> bucket_offsets(ref.index.bucket_offsets, ref.index.bucket_offsets + header.n_bucket_offsets);
+		std::vector<loc_t> buckets_data(ref.index.buckets_data, ref.index.buckets_data + header.n_entries);
+		ref.index.release();
+		ref.index.bucket_offsets_buf.swap(bucket_offsets);
+		ref.index.buckets_data_buf.swap(buckets_data);
+		ref.index.attach_buffers();
+		sort_index_buckets(ref.index, params);
 	}
-	file.close();
 }
 
 /* Reads I/O */
@@ -490,77 +1142,166 @@ void fastq_error(const char* fastqFname) {
 	exit(1);
 }
 
-// loads the read sequences from the FASTQ file
-void fastq2reads(const char *readsFname, reads_t& reads) {
-	FILE *readsFile = (FILE*) fopen(readsFname, "r");
-	if (readsFile == NULL) {
-		printf("load_reads_fastq: Cannot open reads file: %s !\n", readsFname);
-		exit(1);
+// reverse complement of the nt4 encoded sequence
+void nt4_revcomp(const char* in, const uint32 len, char* out) {
+	const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i complement_lut = _mm_setr_epi8(3/*A*/, 2/*G*/, 1/*C*/, 0/*T*/, 4/*N*/, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4);
+	uint32 i = 0;
+	for(; i + 16 <= len; i += 16) {
+		const __m128i c = _mm_loadu_si128((const __m128i*) &in[len - i - 16]);
+		_mm_storeu_si128((__m128i*) &out[i], _mm_shuffle_epi8(complement_lut, _mm_shuffle_epi8(c, reverse)));
 	}
+	for(; i < len; i++) {
+		out[i] = nt4_complement[(int) in[len - i - 1]];
+	}
+}
 
-	reads.fname = readsFname;
-	char c;
-	while(!feof(readsFile)) {
-		read_t r;
-		c = (char) getc(readsFile);
-		while(c != '@' && !feof(readsFile)) {
-			c = (char) getc(readsFile);
-		}
-		if(feof(readsFile)) break;
+bool fastq_reader_t::open(const char* readsFname) {
+	fname = readsFname;
+	data.clear();
+	data_pos = 0;
+	return file.open(readsFname);
+}
 
-		// line 1 (@ ...)
-		c = (char) getc(readsFile);
-		while(c != '\n' && !feof(readsFile)){
-			r.name.append(1, c);
-			c = (char) getc(readsFile);
-		}
-		r.name.append(1, '\0');
-		if(feof(readsFile)) fastq_error(readsFname);
+// moves the unparsed data to the front of the buffer and appends the next block of the file
+// (a newline is added after the last line if missing), returns false at the end of the file
+bool fastq_reader_t::load_block() {
+	data.erase(data.begin(), data.begin() + data_pos);
+	data_pos = 0;
+	if(file.fill()) {
+		data.insert(data.end(), file.buf.begin(), file.buf.begin() + file.buf_len);
+		file.buf_pos = file.buf_len;
+		return true;
+	}
+	if(data.size() > 0 && data.back() != '\n') {
+		data.push_back('\n');
+		return true;
+	}
+	return false;
+}
 
-		while (c != '\n' && !feof(readsFile)) {
-			c = (char) getc(readsFile);
-		}
-		if(feof(readsFile)) fastq_error(readsFname);
+// returns the end of the line starting at the given position, excluding the newline (and the carriage return)
+inline const char* fastq_line_end(const char* line, const char* end) {
+	const char* nl = (const char*) memchr(line, '\n', end - line);
+	if(nl == NULL) {
+		return NULL;
+	}
+	return (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+}
 
-		// line 2 (sequence letters)
-		c = (char) getc(readsFile);
-		while (c != '\n' && !feof(readsFile)) {
-			r.seq.append(1, nt4_table[(int) c]);
-			c = (char) getc(readsFile);
-		}
-		r.len = r.seq.size();
-		if(feof(readsFile)) fastq_error(readsFname);
+inline const char* fastq_next_line(const char* line_end) {
+	return line_end + (*line_end == '\r' ? 2 : 1);
+}
 
-		while (c != '+' && !feof(readsFile)) {
-			c = (char) getc(readsFile);
-		}
-		if(feof(readsFile)) fastq_error(readsFname);
+// locates the lines of the record starting at the given position ('@'),
+// returns false if the record is incomplete
+inline bool fastq_locate_record(const char* rec, const char* end, fastq_record_t& loc) {
+	const char* name_end = fastq_line_end(rec, end);
+	if(name_end == NULL) return false;
+	const char* seq = fastq_next_line(name_end);
+	const char* seq_end = fastq_line_end(seq, end);
+	if(seq_end == NULL) return false;
+	const char* sep = fastq_next_line(seq_end);
+	const char* sep_end = fastq_line_end(sep, end);
+	if(sep_end == NULL) return false;
+	const char* qual = fastq_next_line(sep_end);
+	const char* qual_end = fastq_line_end(qual, end);
+	if(qual_end == NULL) return false;
+	loc.name_len = name_end - rec - 1;
+	loc.len = seq_end - seq;
+	loc.seq_start = seq - rec;
+	loc.sep_start = sep - rec;
+	loc.qual_len = qual_end - qual;
+	loc.end = fastq_next_line(qual_end) - rec;
+	return true;
+}
 
-		// line 3 (+ ...)
-		while(c != '\n' && !feof(readsFile)){
-			c = (char) getc(readsFile);
-		}
-		if(feof(readsFile)) fastq_error(readsFname);
+// parses the located FASTQ record into the read and the batch arenas
+void fastq_parse_record(const char* rec, const fastq_record_t& loc, read_batch_t& batch, read_t& r, const char* fname) {
+	if(rec[loc.sep_start] != '+') fastq_error(fname);
+	if(loc.qual_len != loc.len) {
+		printf("Error: The number of quality score symbols does not match the length of the read sequence.\n");
+		exit(1);
+	}
+	r.len = loc.len;
+	r.name_offset = loc.name_offset;
+	r.seq_offset = loc.seq_offset;
+	memcpy(&batch.names[loc.name_offset], rec + 1, loc.name_len);
+	batch.names[loc.name_offset + loc.name_len] = '\0';
+	char* seq = &batch.seqs[loc.seq_offset];
+	nt4_encode(rec + loc.seq_start, r.len, seq);
+	nt4_revcomp(seq, r.len, seq + r.len);
+}
 
-		// line 4 (quality values)
-		uint32 qualLen = 0;
-		c = (char) getc(readsFile);
-		while(c != '\n' && !feof(readsFile)) {
-			qualLen++;
-			c = (char) getc(readsFile);
+// replaces the reads with the next (at most max_reads) reads of the file
+// the file is read in blocks: the complete records of each block are located serially
+// (assigning their space in the batch arenas) and parsed in parallel
+uint32 fastq_reader_t::next_batch(read_batch_t& reads, const uint32 max_reads) {
+	reads.fname = fname;
+	reads.clear();
+	if(max_reads != UINT32_MAX) {
+		reads.reads.reserve(max_reads);
+	}
+	std::vector<fastq_record_t> records;
+	while(reads.reads.size() < max_reads) {
+		// locate the complete records in the buffer
+		records.clear();
+		uint64 pos = data_pos;
+		uint64 names_size = reads.names.size();
+		uint64 seqs_size = reads.seqs.size();
+		while(reads.reads.size() + records.size() < max_reads) {
+			const char* rec = (const char*) memchr(data.data() + pos, '@', data.size() - pos); // skip the text between the records
+			if(rec == NULL) {
+				pos = data.size();
+				break;
+			}
+			fastq_record_t loc;
+			loc.start = rec - data.data();
+			if(!fastq_locate_record(rec, data.data() + data.size(), loc)) {
+				pos = loc.start;
+				break;
+			}
+			loc.name_offset = names_size;
+			loc.seq_offset = seqs_size;
+			names_size += loc.name_len + 1;
+			seqs_size += 2*loc.len;
+			records.push_back(loc);
+			pos = loc.start + loc.end;
 		}
-		if(qualLen != r.len) {
-			printf("Error: The number of quality score symbols does not match the length of the read sequence.\n");
-			exit(1);
+		if(records.size() == 0) {
+			data_pos = pos;
+			if(!load_block()) {
+				if(data_pos < data.size()) fastq_error(fname); // truncated record
+				break;
+			}
+			continue;
 		}
 
-		// compute the reverse complement
-		for(uint32 i = 0; i < r.len; i++) {
-			r.rc.append(1, nt4_complement[(int)r.seq.at(r.len-i-1)]);
+		const uint64 n_parsed = reads.reads.size();
+		reads.reads.resize(n_parsed + records.size());
+		reads.names.resize(names_size);
+		reads.seqs.resize(seqs_size);
+		// the team size is set explicitly: the batch may be parsed on a thread that is not managed by OpenMP
+		const int n_parse_threads = n_threads > 0 ? n_threads : omp_get_max_threads();
+		#pragma omp parallel for schedule(dynamic, FASTQ_PARSE_GRAIN) num_threads(n_parse_threads)
+		for(uint64 i = 0; i < records.size(); i++) {
+			fastq_parse_record(data.data() + records[i].start, records[i], reads, reads.reads[n_parsed + i], fname);
 		}
-		reads.reads.push_back(r);
+		data_pos = pos;
+	}
+	reads.attach_seqs();
+	return reads.reads.size();
+}
+
+// loads the read sequences from the FASTQ file
+void fastq2reads(const char *readsFname, read_batch_t& reads) {
+	fastq_reader_t reader;
+	if (!reader.open(readsFname)) {
+		printf("load_reads_fastq: Cannot open reads file: %s !\n", readsFname);
+		exit(1);
 	}
-	fclose(readsFile);
+	reader.next_batch(reads, UINT32_MAX);
+	reader.file.close();
 }
 
 // assumes that reads were generated with wgsim
@@ -581,12 +1322,12 @@ void parse_read_mapping(const char* read_name, unsigned int* seq_id, unsigned in
     *ref_pos_r = atoi(refr.c_str());
 }
 
-void get_sim_read_info(const ref_t& ref, reads_t& reads) {
+void get_sim_read_info(const ref_t& ref, read_batch_t& reads) {
 #if(SIM_EVAL)
 	#pragma omp parallel for
 	for (uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
-		parse_read_mapping(r->name.c_str(), &r->seq_id, &r->ref_pos_l, &r->ref_pos_r, &r->strand);
+		parse_read_mapping(r->name, &r->seq_id, &r->ref_pos_l, &r->ref_pos_r, &r->strand);
 		r->seq_id = r->seq_id - 1;
 		if(ref.subsequence_offsets.size() > 1) {
 			r->ref_pos_l += ref.subsequence_offsets[r->seq_id]; // convert to global id
@@ -597,7 +1338,7 @@ void get_sim_read_info(const ref_t& ref, reads_t& reads) {
 }
 
 void print_read(read_t* read) {
-	printf("%s \n", read->name.c_str());
+	printf("%s \n", read->name);
 	for(uint32 i = 0; i < read->len; i++) {
 		printf("%c", iupacChar[(int) read->seq[i]]);
 	}
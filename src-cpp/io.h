@@ -1,6 +1,7 @@
 #ifndef IO_H_
 #define IO_H_
 
+#include <zlib.h>
 #include "types.h"
 #include "index.h"
 
@@ -28,21 +29,183 @@ static const unsigned char nt4_table[256] = {
 };
 
 
+// binary reference cache: the packed reference, the sequence offsets and names,
+// tied to the size and modification time of the FASTA file and mapped in place
+#define REF_BIN_MAGIC 0x3130464552524c42ULL // "BLRREF01"
+
+typedef struct {
+	uint64 magic;
+	uint64 fasta_size;
+	uint64 fasta_mtime_sec;
+	uint64 fasta_mtime_nsec;
+	uint64 len;						// reference sequence length
+	uint64 n_words;					// number of packed sequence words
+	uint64 n_n_runs;				// number of N runs
+	uint64 n_seqs;					// number of sequences
+	uint64 names_size;				// size of the sequence names ('\0'-terminated)
+	uint64 words_start;				// file offset of the packed sequence words
+	uint64 n_runs_start;			// file offset of the N runs
+	uint64 offsets_start;			// file offset of the sequence offsets
+	uint64 names_start;				// file offset of the sequence names
+	uint64 file_size;
+} ref_bin_header_t;
+
+// sequence input file: plain text, gzip or BGZF compressed
+// (the BGZF blocks are inflated in parallel one batch at a time)
+typedef enum {SEQ_FILE_PLAIN = 0, SEQ_FILE_GZIP = 1, SEQ_FILE_BGZF = 2} seq_file_format;
+
+#define SEQ_FILE_BUF_SIZE (1 << 22)
+#define BGZF_HEADER_SIZE 18
+#define BGZF_BATCH_SIZE (1 << 24) // compressed bytes read per batch
+
+struct seq_file_t {
+	seq_file_format format;
+	int fd;
+	gzFile gz;
+	std::vector<char> buf;			// decompressed data
+	uint64 buf_pos;
+	uint64 buf_len;
+	std::vector<char> bgzf_data;	// compressed data of the current BGZF batch
+	uint64 bgzf_len;
+	bool at_eof;					// a read was attempted past the end of the file
+	bool input_done;				// all the input data was consumed
+
+	seq_file_t() : format(SEQ_FILE_PLAIN), fd(-1), gz(NULL), buf_pos(0), buf_len(0), bgzf_len(0), at_eof(false), input_done(false) {}
+	~seq_file_t() {
+		close();
+	}
+
+	bool open(const char* fname);
+	void close();
+	bool fill();
+	void fill_bgzf();
+	void read_all(std::vector<char>& out);
+
+	// same semantics as getc/feof
+	inline int getc() {
+		if(buf_pos == buf_len && !fill()) {
+			at_eof = true;
+			return EOF;
+		}
+		return (uint8) buf[buf_pos++];
+	}
+
+	inline bool eof() const {
+		return at_eof;
+	}
+};
+
 void fasta2ref(const char *fastaFname, ref_t& ref);
-void fastq2reads(const char *readsFname, reads_t& reads);
+void store_ref_bin(const char* fastaFname, const ref_t& ref);
+bool load_ref_bin(const char* fastaFname, ref_t& ref);
+void load_packed_ref(const char* fastaFname, ref_t& ref);
+void nt4_encode(const char* in, const uint32 len, char* out);
+void pack_ref_seq(ref_t& ref);
+void release_ref_seq(ref_t& ref);
+uint64 ref_seq_checksum(const ref_t& ref);
+void nt4_revcomp(const char* in, const uint32 len, char* out);
+
+#define FASTQ_PARSE_GRAIN 256 // records parsed per scheduled chunk
+
+// location of a FASTQ record in the reader block and of its read in the batch arenas
+typedef struct {
+	uint64 start;				// offset of the record ('@') in the block
+	uint64 end;					// offsets relative to the record start
+	uint32 seq_start;
+	uint32 sep_start;
+	uint32 name_len;
+	uint32 len;
+	uint32 qual_len;
+	uint64 name_offset;
+	uint64 seq_offset;
+} fastq_record_t;
+
+// FASTQ reader loading the reads in batches
+// (4-line records, the sequence and quality values on a single line each)
+struct fastq_reader_t {
+	seq_file_t file;
+	const char* fname;
+	std::vector<char> data;			// current block of the file
+	uint64 data_pos;				// start of the unparsed data in the block
+	uint32 n_threads;				// number of threads parsing the records (0 - the OpenMP default)
+
+	fastq_reader_t() : fname(NULL), data_pos(0), n_threads(0) {}
+
+	bool open(const char* readsFname);
+	bool load_block();
+	uint32 next_batch(read_batch_t& reads, const uint32 max_reads);
+};
+
+void fastq2reads(const char *readsFname, read_batch_t& reads);
 void print_read(read_t* read);
 void parse_read_mapping(const char* read_name, unsigned int* seq_id, unsigned int* ref_pos_l, unsigned int* ref_pos_r, int* strand);
-void get_sim_read_info(const ref_t& ref, reads_t& reads);
+void get_sim_read_info(const ref_t& ref, read_batch_t& reads);
+#define WINDOW_MASK_MAGIC 0x31304b534d574c42ULL // "BLWMSK01"
 void store_valid_window_mask(const char* refFname, const ref_t& ref, const index_params_t* params);
 bool load_valid_window_mask(const char* refFname, ref_t& ref, const index_params_t* params);
 
 // index io
-void store_ref_idx_flat(const char* refFname, const ref_t& ref, const index_params_t* params);
-void load_ref_idx_flat(const char* refFname, ref_t& ref, const index_params_t* params);  
+// the index file is a header, the hash functions used to build the index,
+// and the page-aligned bucket offsets and bucket entries arrays, such that it can be mapped and used in place
+// (in the packed layout the bucket entries array is replaced by the bucket byte offsets and the packed entries,
+// in the SoA layout by the hash, pos and len columns; the optional bucket hash directory arrays follow the bucket entries)
+#define REF_IDX_MAGIC 0x3830584449524c42ULL // "BLRIDX08"
+#define REF_IDX_FLAG_SORTED 1ULL // bucket entries are ordered by (hash, pos)
+#define REF_IDX_ALIGNMENT 4096
+
+inline uint64 ref_idx_align(const uint64 offset) {
+	return (offset + REF_IDX_ALIGNMENT - 1) / REF_IDX_ALIGNMENT * REF_IDX_ALIGNMENT;
+}
+
+typedef struct {
+	uint64 magic;
+	uint64 flags;
+	uint64 header_checksum;			// checksum of the header (with this field set to 0) and the hash state
+	uint64 data_checksum;			// checksum of the bucket arrays
+
+	// index parameters
+	uint32 alg;
+	uint32 k;
+	uint32 h;
+	uint32 n_tables;
+	uint32 sketch_proj_len;
+	uint32 n_buckets_pow2;
+	uint32 ref_window_size;
+	uint32 layout;
+	uint32 packed_pos_bytes;
+	uint32 reserved;
+	uint64 max_count;
+
+	// build fingerprint
+	uint64 build_time;
+	uint64 ref_len;
+	uint64 n_ref_seqs;
+	uint64 ref_seq_checksum;
+
+	// layout
+	uint64 hash_state_start;		// file offset of the serialized hash functions and sketch projections
+	uint64 hash_state_size;
+	uint64 n_bucket_offsets;		// number of bucket ids + 1
+	uint64 n_entries;				// number of bucket entries
+	uint64 bucket_offsets_start;	// file offset of the bucket offsets array
+	uint64 buckets_data_start;		// file offset of the bucket entries array (flat layout)
+	uint64 bucket_byte_offsets_start; // file offset of the bucket byte offsets array (packed layout)
+	uint64 packed_data_start;		// file offset of the packed bucket entries (packed layout)
+	uint64 n_packed_bytes;
+	uint64 bucket_hashes_start;		// file offset of the hash column (SoA layout)
+	uint64 bucket_pos_start;		// file offset of the pos column (SoA layout)
+	uint64 bucket_lens_start;		// file offset of the len column (SoA layout)
+	uint64 n_dir_entries;			// number of bucket hash directory entries (0 if no directory)
+	uint64 bucket_dir_offsets_start; // file offset of the bucket hash directory offsets array
+	uint64 dir_hashes_start;		// file offset of the directory hashes array
+	uint64 dir_starts_start;		// file offset of the directory run starts array
+	uint64 file_size;
+} ref_idx_header_t;
+
+std::string ref_idx_fname(const char* refFname, const index_params_t* params);
+bool load_ref_idx_params(const char* refFname, index_params_t* params);
 void store_ref_idx(const char* idxFname, const ref_t& ref, const index_params_t* params);
 void load_ref_idx(const char* idxFname, ref_t& ref, const index_params_t* params);
-void store_ref_idx_per_thread(const int tid, const bool first_entry, const char* refFname, ref_t& ref, const index_params_t* params);
-void load_ref_idx_per_thread(const int tid, const int nloads, const char* refFname, ref_t& ref, index_params_t* params);
 void compute_store_kmer2_hashes(const char* refFname, ref_t& ref, const index_params_t* params);
 bool load_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params);
 void compute_store_repeat_info(const char* refFname, ref_t& ref, const index_params_t* params);
@@ -55,13 +218,15 @@ bool load_repeat_local(const char* refFname, ref_t& ref, const index_params_t* p
 
 // stats
 void compute_and_store_kmer_hist32(const char* refFname, const char* seq, const seq_t seq_len, const index_params_t* params);
-void compute_and_store_kmer_hist16(const char* refFname, const char* seq, const seq_t seq_len, const index_params_t* params);
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params);
+std::string freq_kmer_filter_fname(const char* refFname, const index_params_t* params);
 void store_kmer_hist_stat(const char* refFname, const MapKmerCounts& hist);
 void load_freq_kmers(const char* refFname, std::set<uint64>& freq_kmers, const index_params_t* params);
-void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, MarisaTrie& freq_trie, const uint32 max_count_threshold);
+void load_freq_kmers(const char* refFname, freq_kmer_filter_t& freq_filter, MarisaTrie& freq_trie, const index_params_t* params);
 void kmer_stats(const char* refFname);
 void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_params_t* params);
 void ref_kmer_repeat_stats(const char* fastaFname, index_params_t* params, ref_t& ref);
+void minhash_kernel_bench(const char* refFname, const char* readsFname, index_params_t* params);
 
 // compression
 #define CHARS_PER_SHORT 8   // number of chars in 16 bits
@@ -74,6 +239,88 @@ void ref_kmer_repeat_stats(const char* fastaFname, index_params_t* params, ref_t
 #define KMER_HIST_SIZE16 (1ULL << 16) //65536
 #define KMER_HIST_SIZE32 (1ULL << 32)
 
+// rolling 2-bit kmer encoder: slides a kmer of length k (k <= CHARS_PER_WORD) over the sequence one base at a time,
+// keeping its packed encoding and the number of ambiguous bases it contains
+struct kmer_iter_t {
+	const char* seq;
+	uint32 k;
+	uint32 mask;		// low 2k bits
+	uint32 kmer;		// packed kmer, last base in the low bits
+	uint32 n_ambig;		// number of ambiguous bases in the kmer
+	seq_t pos;			// start position of the current kmer
+
+	kmer_iter_t(const char* seq = NULL, const uint32 k = 0) :
+		seq(seq), k(k), mask((uint32) ((1ULL << (BITS_PER_CHAR*k)) - 1)), kmer(0), n_ambig(0), pos(0) {}
+
+	// moves the iterator to the kmer starting at the given position
+	inline void reset(const seq_t start_pos) {
+		kmer = 0;
+		n_ambig = 0;
+		pos = start_pos;
+		for(uint32 i = 0; i < k; i++) {
+			push(seq[start_pos + i]);
+		}
+	}
+
+	// moves the iterator to the next kmer
+	inline void next() {
+		n_ambig -= (seq[pos] == BASE_IGNORE);
+		push(seq[pos + k]);
+		pos++;
+	}
+
+	inline void push(const char c) {
+		kmer = ((kmer << BITS_PER_CHAR) | (c & 3)) & mask;
+		n_ambig += (c == BASE_IGNORE);
+	}
+
+	// true if the kmer does not contain ambiguous bases
+	inline bool valid() const {
+		return n_ambig == 0;
+	}
+
+	// kmer encoding as computed by pack_32 (first base in the high bits)
+	inline uint32 packed() const {
+		return kmer << (BITS_IN_WORD - BITS_PER_CHAR*k);
+	}
+};
+
+// rolling 2-bit encoder of a kmer and its reverse complement (nt4 complement: 3 - c)
+// the reverse complement of the kmer starting at position i is the kmer of the reverse complement sequence at len - k - i
+struct dual_kmer_iter_t : public kmer_iter_t {
+	uint32 rc_mask;		// high 2k bits
+	uint32 rc_kmer;		// packed reverse complement kmer, first base in the high bits
+
+	dual_kmer_iter_t(const char* seq = NULL, const uint32 k = 0) :
+		kmer_iter_t(seq, k), rc_mask(~0U << (BITS_IN_WORD - BITS_PER_CHAR*k)), rc_kmer(0) {}
+
+	inline void reset(const seq_t start_pos) {
+		kmer = 0;
+		rc_kmer = 0;
+		n_ambig = 0;
+		pos = start_pos;
+		for(uint32 i = 0; i < k; i++) {
+			push(seq[start_pos + i]);
+		}
+	}
+
+	inline void next() {
+		n_ambig -= (seq[pos] == BASE_IGNORE);
+		push(seq[pos + k]);
+		pos++;
+	}
+
+	inline void push(const char c) {
+		kmer_iter_t::push(c);
+		rc_kmer = ((rc_kmer >> BITS_PER_CHAR) | ((uint32) (3 - (c & 3)) << (BITS_IN_WORD - BITS_PER_CHAR))) & rc_mask;
+	}
+
+	// reverse complement kmer encoding as computed by pack_32
+	inline uint32 packed_rc() const {
+		return rc_kmer;
+	}
+};
+
 int pack_16(const char *seq, const int length, uint16_t *ret);
 int pack_32(const char *seq, const int length, uint32_t *ret); 
 int pack_64(const char *seq, const int length, uint64 *ret);
@@ -9,6 +9,8 @@
 #include <math.h>
 #include <time.h>
 #include "limits.h"
+#include <algorithm>
+#include <immintrin.h>
 #include "lsh.h"
 #include "hash.h"
 
@@ -76,59 +78,359 @@ uint32_t get_kmer_weight(const char* kmer_seq, uint32 kmer_len,
 /////////////////////////
 // --- LSH: minhash ---
 
+// min-hash kernels: min_hashes[h] = min over the kmers of a_h*kmer_hash
+// each pass over the kmer hashes updates MINHASH_KERNEL_FUNCS hash functions at once,
+// the kmer hash buffer is padded to the vector width with copies of the first hash (they do not change the minima)
+
+#define MINHASH_KERNEL_FUNCS 4
+
+void minhash_kernel_scalar(minhash_t* kmer_hashes, const uint32 n_kmers, const VectorHashFunctions& funcs, const uint32 n_funcs, minhash_t* min_hashes) {
+	uint32 h = 0;
+	for(; h + MINHASH_KERNEL_FUNCS <= n_funcs; h += MINHASH_KERNEL_FUNCS) {
+		const minhash_t a0 = funcs[h].a, a1 = funcs[h+1].a, a2 = funcs[h+2].a, a3 = funcs[h+3].a;
+		minhash_t m0 = UINT_MAX, m1 = UINT_MAX, m2 = UINT_MAX, m3 = UINT_MAX;
+		for(uint32 i = 0; i < n_kmers; i++) {
+			const minhash_t x = kmer_hashes[i];
+			m0 = std::min(m0, a0*x);
+			m1 = std::min(m1, a1*x);
+			m2 = std::min(m2, a2*x);
+			m3 = std::min(m3, a3*x);
+		}
+		min_hashes[h] = m0;
+		min_hashes[h+1] = m1;
+		min_hashes[h+2] = m2;
+		min_hashes[h+3] = m3;
+	}
+	for(; h < n_funcs; h++) {
+		const minhash_t a = funcs[h].a;
+		minhash_t m = UINT_MAX;
+		for(uint32 i = 0; i < n_kmers; i++) {
+			m = std::min(m, a*kmer_hashes[i]);
+		}
+		min_hashes[h] = m;
+	}
+}
+
+inline minhash_t hmin_epu32_sse41(__m128i v) {
+	v = _mm_min_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_min_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+void minhash_kernel_sse41(minhash_t* kmer_hashes, const uint32 n_kmers, const VectorHashFunctions& funcs, const uint32 n_funcs, minhash_t* min_hashes) {
+	for(uint32 i = n_kmers; i % 4 != 0; i++) {
+		kmer_hashes[i] = kmer_hashes[0];
+	}
+	const __m128i* x = (const __m128i*) kmer_hashes;
+	const uint32 n_vecs = (n_kmers + 3)/4;
+	uint32 h = 0;
+	for(; h + MINHASH_KERNEL_FUNCS <= n_funcs; h += MINHASH_KERNEL_FUNCS) {
+		const __m128i a0 = _mm_set1_epi32(funcs[h].a), a1 = _mm_set1_epi32(funcs[h+1].a);
+		const __m128i a2 = _mm_set1_epi32(funcs[h+2].a), a3 = _mm_set1_epi32(funcs[h+3].a);
+		__m128i m0 = _mm_set1_epi32(-1), m1 = m0, m2 = m0, m3 = m0;
+		for(uint32 i = 0; i < n_vecs; i++) {
+			const __m128i v = _mm_loadu_si128(&x[i]);
+			m0 = _mm_min_epu32(m0, _mm_mullo_epi32(v, a0));
+			m1 = _mm_min_epu32(m1, _mm_mullo_epi32(v, a1));
+			m2 = _mm_min_epu32(m2, _mm_mullo_epi32(v, a2));
+			m3 = _mm_min_epu32(m3, _mm_mullo_epi32(v, a3));
+		}
+		min_hashes[h] = hmin_epu32_sse41(m0);
+		min_hashes[h+1] = hmin_epu32_sse41(m1);
+		min_hashes[h+2] = hmin_epu32_sse41(m2);
+		min_hashes[h+3] = hmin_epu32_sse41(m3);
+	}
+	for(; h < n_funcs; h++) {
+		const __m128i a = _mm_set1_epi32(funcs[h].a);
+		__m128i m = _mm_set1_epi32(-1);
+		for(uint32 i = 0; i < n_vecs; i++) {
+			m = _mm_min_epu32(m, _mm_mullo_epi32(_mm_loadu_si128(&x[i]), a));
+		}
+		min_hashes[h] = hmin_epu32_sse41(m);
+	}
+}
+
+__attribute__((target("avx2")))
+inline minhash_t hmin_epu32_avx2(const __m256i v) {
+	__m128i m = _mm_min_epu32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(m);
+}
+
+__attribute__((target("avx2")))
+void minhash_kernel_avx2(minhash_t* kmer_hashes, const uint32 n_kmers, const VectorHashFunctions& funcs, const uint32 n_funcs, minhash_t* min_hashes) {
+	for(uint32 i = n_kmers; i % 8 != 0; i++) {
+		kmer_hashes[i] = kmer_hashes[0];
+	}
+	const __m256i* x = (const __m256i*) kmer_hashes;
+	const uint32 n_vecs = (n_kmers + 7)/8;
+	uint32 h = 0;
+	for(; h + MINHASH_KERNEL_FUNCS <= n_funcs; h += MINHASH_KERNEL_FUNCS) {
+		const __m256i a0 = _mm256_set1_epi32(funcs[h].a), a1 = _mm256_set1_epi32(funcs[h+1].a);
+		const __m256i a2 = _mm256_set1_epi32(funcs[h+2].a), a3 = _mm256_set1_epi32(funcs[h+3].a);
+		__m256i m0 = _mm256_set1_epi32(-1), m1 = m0, m2 = m0, m3 = m0;
+		for(uint32 i = 0; i < n_vecs; i++) {
+			const __m256i v = _mm256_loadu_si256(&x[i]);
+			m0 = _mm256_min_epu32(m0, _mm256_mullo_epi32(v, a0));
+			m1 = _mm256_min_epu32(m1, _mm256_mullo_epi32(v, a1));
+			m2 = _mm256_min_epu32(m2, _mm256_mullo_epi32(v, a2));
+			m3 = _mm256_min_epu32(m3, _mm256_mullo_epi32(v, a3));
+		}
+		min_hashes[h] = hmin_epu32_avx2(m0);
+		min_hashes[h+1] = hmin_epu32_avx2(m1);
+		min_hashes[h+2] = hmin_epu32_avx2(m2);
+		min_hashes[h+3] = hmin_epu32_avx2(m3);
+	}
+	for(; h < n_funcs; h++) {
+		const __m256i a = _mm256_set1_epi32(funcs[h].a);
+		__m256i m = _mm256_set1_epi32(-1);
+		for(uint32 i = 0; i < n_vecs; i++) {
+			m = _mm256_min_epu32(m, _mm256_mullo_epi32(_mm256_loadu_si256(&x[i]), a));
+		}
+		min_hashes[h] = hmin_epu32_avx2(m);
+	}
+}
+
+// with GCC 12 the unmasked avx512 intrinsics pass an undefined source vector that trips -Wmaybe-uninitialized,
+// so the kernel uses the zero-masked forms with all the lanes enabled
+#define AVX512_ALL_LANES ((__mmask16) -1)
+
+__attribute__((target("avx512f")))
+inline minhash_t hmin_epu32_avx512(const __m512i v) {
+	return hmin_epu32_avx2(_mm256_min_epu32(_mm512_maskz_extracti64x4_epi64((__mmask8) -1, v, 0),
+			_mm512_maskz_extracti64x4_epi64((__mmask8) -1, v, 1)));
+}
+
+__attribute__((target("avx512f")))
+void minhash_kernel_avx512(minhash_t* kmer_hashes, const uint32 n_kmers, const VectorHashFunctions& funcs, const uint32 n_funcs, minhash_t* min_hashes) {
+	for(uint32 i = n_kmers; i % 16 != 0; i++) {
+		kmer_hashes[i] = kmer_hashes[0];
+	}
+	const __m512i* x = (const __m512i*) kmer_hashes;
+	const uint32 n_vecs = (n_kmers + 15)/16;
+	uint32 h = 0;
+	for(; h + MINHASH_KERNEL_FUNCS <= n_funcs; h += MINHASH_KERNEL_FUNCS) {
+		const __m512i a0 = _mm512_set1_epi32(funcs[h].a), a1 = _mm512_set1_epi32(funcs[h+1].a);
+		const __m512i a2 = _mm512_set1_epi32(funcs[h+2].a), a3 = _mm512_set1_epi32(funcs[h+3].a);
+		__m512i m0 = _mm512_set1_epi32(-1), m1 = m0, m2 = m0, m3 = m0;
+		for(uint32 i = 0; i < n_vecs; i++) {
+			const __m512i v = _mm512_loadu_si512(&x[i]);
+			m0 = _mm512_maskz_min_epu32(AVX512_ALL_LANES, m0, _mm512_mullo_epi32(v, a0));
+			m1 = _mm512_maskz_min_epu32(AVX512_ALL_LANES, m1, _mm512_mullo_epi32(v, a1));
+			m2 = _mm512_maskz_min_epu32(AVX512_ALL_LANES, m2, _mm512_mullo_epi32(v, a2));
+			m3 = _mm512_maskz_min_epu32(AVX512_ALL_LANES, m3, _mm512_mullo_epi32(v, a3));
+		}
+		min_hashes[h] = hmin_epu32_avx512(m0);
+		min_hashes[h+1] = hmin_epu32_avx512(m1);
+		min_hashes[h+2] = hmin_epu32_avx512(m2);
+		min_hashes[h+3] = hmin_epu32_avx512(m3);
+	}
+	for(; h < n_funcs; h++) {
+		const __m512i a = _mm512_set1_epi32(funcs[h].a);
+		__m512i m = _mm512_set1_epi32(-1);
+		for(uint32 i = 0; i < n_vecs; i++) {
+			m = _mm512_maskz_min_epu32(AVX512_ALL_LANES, m, _mm512_mullo_epi32(_mm512_loadu_si512(&x[i]), a));
+		}
+		min_hashes[h] = hmin_epu32_avx512(m);
+	}
+}
+
+const minhash_kernel_info_t minhash_kernels[] = {
+	{ "avx512", "avx512f", minhash_kernel_avx512 },
+	{ "avx2", "avx2", minhash_kernel_avx2 },
+	{ "sse4.1", "sse4.1", minhash_kernel_sse41 },
+	{ "scalar", NULL, minhash_kernel_scalar },
+};
+const uint32 n_minhash_kernels = sizeof(minhash_kernels)/sizeof(minhash_kernels[0]);
+
+bool minhash_kernel_supported(const minhash_kernel_info_t& kernel) {
+	__builtin_cpu_init();
+	if(kernel.cpu_feature == NULL) return true;
+	if(strcmp(kernel.cpu_feature, "avx512f") == 0) return __builtin_cpu_supports("avx512f");
+	if(strcmp(kernel.cpu_feature, "avx2") == 0) return __builtin_cpu_supports("avx2");
+	return __builtin_cpu_supports("sse4.1");
+}
+
+// picks the widest kernel supported by the cpu (or the one named by the MINHASH_ISA environment variable)
+static const minhash_kernel_info_t* select_minhash_kernel() {
+	const char* isa = getenv("MINHASH_ISA");
+	if(isa != NULL && isa[0] == '\0') isa = NULL;
+	for(uint32 i = 0; i < n_minhash_kernels; i++) {
+		if(isa != NULL && strcmp(isa, minhash_kernels[i].name) != 0) continue;
+		if(minhash_kernel_supported(minhash_kernels[i])) {
+			return &minhash_kernels[i];
+		}
+	}
+	if(isa != NULL) {
+		printf("select_minhash_kernel: MinHash kernel %s is not available on this cpu!\n", isa);
+		exit(1);
+	}
+	return &minhash_kernels[n_minhash_kernels - 1];
+}
+
+const minhash_kernel_info_t* minhash_kernel = select_minhash_kernel();
+
+// --- LSH: one-permutation min-hash ---
+// (one-permutation hashing with optimal densification, Shrivastava 2017)
+// each kmer hash is assigned to one of the h bins by its high bits and each bin keeps its minimum,
+// so a kmer is hashed once instead of h times; every empty bin then borrows the value of the first
+// non-empty bin on its own pseudo-random probe sequence (the same for all the sequences)
+
+#define OPH_DENSIFY_MAX_PROBES 1024
+
+inline uint32 oph_bin(const minhash_t kmer_hash, const uint32 n_bins) {
+	return ((uint64) kmer_hash * n_bins) >> 32;
+}
+
+// bin probed by the given attempt to fill an empty bin
+inline uint32 oph_probe(const uint32 bin, const uint32 attempt, const uint32 n_bins) {
+	uint32 x = ((bin + 1)*0x9e3779b1 ^ attempt)*0x85ebca6b;
+	x ^= x >> 15;
+	x *= 0x2c1b3c6d;
+	return oph_bin(x, n_bins);
+}
+
+// fills the signature from the bin minima (at least one bin must be non-empty)
+void oph_densify(const minhash_t* bins, const uint32 n_bins, minhash_t* min_hashes) {
+	for(uint32 start = 0; start < n_bins; start += 64) {
+		// copy a group of bins and mark the empty ones (branch-free, the empty bins are scattered at random)
+		const uint32 end = std::min(start + 64, n_bins);
+		uint64 empty_mask = 0;
+		for(uint32 b = start; b < end; b++) {
+			min_hashes[b] = bins[b];
+			empty_mask |= (uint64) (bins[b] == UINT_MAX) << (b - start);
+		}
+		for(; empty_mask != 0; empty_mask &= empty_mask - 1) {
+			const uint32 b = start + __builtin_ctzll(empty_mask);
+			uint32 src = n_bins;
+			for(uint32 attempt = 0; attempt < OPH_DENSIFY_MAX_PROBES; attempt++) {
+				const uint32 p = oph_probe(b, attempt, n_bins);
+				if(bins[p] != UINT_MAX) {
+					src = p;
+					break;
+				}
+			}
+			if(src == n_bins) { // very sparse bins: fall back to the next non-empty bin
+				src = b;
+				while(bins[src] == UINT_MAX) {
+					src = (src + 1 == n_bins) ? 0 : src + 1;
+				}
+			}
+			min_hashes[b] = bins[src];
+		}
+	}
+}
+
+// one-permutation signature of a non-empty set of kmer hashes (bins: room for n_bins values)
+void oph_sketch(const minhash_t* kmer_hashes, const uint32 n_kmers, const uint32 n_bins,
+		minhash_t* bins, minhash_t* min_hashes) {
+	std::fill(bins, bins + n_bins, UINT_MAX);
+	for(uint32 i = 0; i < n_kmers; i++) {
+		const minhash_t v = kmer_hashes[i];
+		const uint32 b = oph_bin(v, n_bins);
+		bins[b] = std::min(bins[b], v);
+	}
+	oph_densify(bins, n_bins, min_hashes);
+}
+
+// signature of a non-empty set of kmer hashes with the LSH scheme of the index
+// (the kmer hash buffer must be padded as required by the min-hash kernels, bins is used by OPH)
+void minhash_sketch(minhash_t* kmer_hashes, const uint32 n_kmers, const index_params_t* params,
+		minhash_t* bins, minhash_t* min_hashes) {
+	if(params->alg == OPH) {
+		oph_sketch(kmer_hashes, n_kmers, params->h, bins, min_hashes);
+	} else {
+		minhash_kernel->run(kmer_hashes, n_kmers, params->minhash_functions, params->h, min_hashes);
+	}
+}
+
 bool minhash(const char* seq, const seq_t seq_len,
-			const VectorBool& ref_freq_kmer_bitmap,
+			const freq_kmer_filter_t& ref_freq_kmer_filter,
 			const MarisaTrie& ref_freq_kmer_trie,
 			const MarisaTrie& reads_hist,
 			const index_params_t* params,
 			VectorMinHash& min_hashes) {
 
-	bool any_valid_kmers = false;
 	uint32 n_valid_kmers = 0;
+	VectorMinHash kmer_hashes(seq_len - params->k + 1 + MINHASH_KERNEL_PAD);
+	VectorMinHash bins(params->h);
 
+	kmer_iter_t kmer_iter(seq, params->k);
 	for(uint32 i = 0; i <= (seq_len - params->k); i++) {
+		if(i == 0) {
+			kmer_iter.reset(0);
+		} else {
+			kmer_iter.next();
+		}
 		// check if this kmer should be discarded
+		if(!kmer_iter.valid()) {
+			continue; // has ambiguous bases
+		}
 #if USE_MARISA
 		if(!get_kmer_weight(&seq[i], params->k, ref_freq_kmer_trie, reads_hist, params)) continue;
 #else
-		uint32_t packed_kmer;
-		if(pack_32(&seq[i], params->k, &packed_kmer) < 0) {
-			continue; // has ambiguous bases
-		}
-		if(ref_freq_kmer_bitmap[packed_kmer]) {
+		if(ref_freq_kmer_filter.contains(kmer_iter.packed())) {
 			continue; // this is a high-freq kmer
 		}
 #endif
+		kmer_hashes[n_valid_kmers] = params->kmer_hasher->encrypt_packed_kmer(kmer_iter.packed());
 		n_valid_kmers++;
-		minhash_t kmer_hash = params->kmer_hasher->encrypt_base_seq(&seq[i], params->k);
-		for(uint32_t h = 0; h < params->h; h++) { // update the min values
-			const rand_hash_function_t* f = &params->minhash_functions[h];
-			minhash_t min = f->apply(kmer_hash);
-			if(min < min_hashes[h] || !any_valid_kmers) {
-				min_hashes[h] = min;
-			}
-		}
-		any_valid_kmers = true;
+	}
+	if(n_valid_kmers > 0) {
+		minhash_sketch(&kmer_hashes[0], n_valid_kmers, params, &bins[0], &min_hashes[0]);
 	}
 
 	return n_valid_kmers > 2*params->k;
 }
 
 void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* params, VectorMinHash& min_hashes) {
-	for(uint32 i = 0; i < encrypted_kmers.size(); i++) {
-		minhash_t kmer_hash = encrypted_kmers[i];
-		for(uint32_t h = 0; h < params->h; h++) { // update the min values
-			const rand_hash_function_t* f = &params->minhash_functions[h];
-			minhash_t min = f->apply(kmer_hash);
-			if(min < min_hashes[h] || (i==0)) {
-				min_hashes[h] = min;
+	if(encrypted_kmers.size() == 0) return;
+	const uint32 n_kmers = encrypted_kmers.size();
+	encrypted_kmers.resize(n_kmers + MINHASH_KERNEL_PAD);
+	VectorMinHash bins(params->h);
+	minhash_sketch(&encrypted_kmers[0], n_kmers, params, &bins[0], &min_hashes[0]);
+}
+
+// avoid redundant computations
+// reference-only
+
+// hashes the kmer with each min-hash function into the next column of the block,
+// updates the block prefix minimum and computes the window minimum
+// (the min-hash functions are a*x, M = w)
+inline void minhash_rolling_push(minhash_matrix_t& m, const minhash_t kmer_hash, const bool kmer_valid,
+		const uint32 n_hash_funcs, VectorMinHash& min_hashes) {
+	minhash_t* __restrict col = &m.block_cols[m.block_pos*n_hash_funcs];
+	minhash_t* __restrict prefix = &m.prefix_min[0];
+	const minhash_t* __restrict suffix = &m.prev_suffix_min[(m.block_pos + 1)*n_hash_funcs];
+	const minhash_t* __restrict mult = &m.hash_mult[0];
+	minhash_t* __restrict out = &min_hashes[0];
+	const minhash_t invalid_mask = kmer_valid ? 0 : UINT_MAX;
+	#pragma omp simd
+	for(uint32 h = 0; h < n_hash_funcs; h++) {
+		const minhash_t v = (mult[h]*kmer_hash) | invalid_mask;
+		col[h] = v;
+		prefix[h] = std::min(prefix[h], v);
+		out[h] = std::min(prefix[h], suffix[h]);
+	}
+
+	m.block_pos++;
+	if(m.block_pos == m.n_block_cols) {
+		// the block is complete: its suffix minima are used by the windows of the next block
+		for(int32_t pos = m.n_block_cols - 2; pos >= 0; pos--) {
+			minhash_t* __restrict cur = &m.block_cols[pos*n_hash_funcs];
+			const minhash_t* __restrict next = &m.block_cols[(pos + 1)*n_hash_funcs];
+			#pragma omp simd
+			for(uint32 h = 0; h < n_hash_funcs; h++) {
+				cur[h] = std::min(cur[h], next[h]);
 			}
 		}
+		std::swap_ranges(m.block_cols.begin(), m.block_cols.end(), m.prev_suffix_min.begin());
+		std::fill(m.prefix_min.begin(), m.prefix_min.end(), UINT_MAX);
+		m.block_pos = 0;
 	}
 }
 
-// avoid redundant computations
-// reference-only
 bool minhash_rolling_init(const char* seq, const seq_t ref_offset, const seq_t seq_len,
 					minhash_matrix_t& rolling_minhash_matrix,
 					const VectorBool& ref_freq_kmer_bitmask,
@@ -136,30 +438,30 @@ bool minhash_rolling_init(const char* seq, const seq_t ref_offset, const seq_t s
 					VectorMinHash& min_hashes) {
 
 	// initialize the rolling matrix
-	rolling_minhash_matrix.h_minhash_cols.resize(seq_len - params->k + 1);
-	for(uint32 pos = 0; pos < seq_len - params->k + 1; pos++) {
-		rolling_minhash_matrix.h_minhash_cols[pos].resize(params->h);
+	minhash_matrix_t& m = rolling_minhash_matrix;
+	m.n_block_cols = seq_len - params->k + 1;
+	m.block_cols.resize(m.n_block_cols*params->h);
+	m.prev_suffix_min.assign((m.n_block_cols + 1)*params->h, UINT_MAX);
+	m.prefix_min.assign(params->h, UINT_MAX);
+	m.hash_mult.resize(params->h);
+	for(uint32 h = 0; h < params->h; h++) {
+		m.hash_mult[h] = params->minhash_functions[h].a;
 	}
-	rolling_minhash_matrix.oldest_col_index = 0;
+	m.block_pos = 0;
+	m.kmer_iter = kmer_iter_t(seq, params->k);
 
+	// the first window is the first block
 	bool any_valid_kmers = false;
-	for(uint32 i = 0; i < seq_len - params->k + 1; i++) {
-		if(!ref_freq_kmer_bitmask[ref_offset + i]) { // check if the kmer should be discarded
-			minhash_t kmer_hash = CityHash32(&seq[ref_offset + i], params->k);
-			for(uint32_t h = 0; h < params->h; h++) { // update the min values
-				const rand_hash_function_t* f = &params->minhash_functions[h];
-				minhash_t min = f->apply(kmer_hash);
-				rolling_minhash_matrix.h_minhash_cols[i][h] = min;
-				if(min < min_hashes[h] || !any_valid_kmers) {
-					min_hashes[h] = min;
-				}
-			}
-			any_valid_kmers = true;
+	for(uint32 i = 0; i < m.n_block_cols; i++) {
+		if(i == 0) {
+			m.kmer_iter.reset(ref_offset);
 		} else {
-			for(uint32_t h = 0; h < params->h; h++) {
-				rolling_minhash_matrix.h_minhash_cols[i][h] = UINT_MAX;
-			}
+			m.kmer_iter.next();
 		}
+		const bool kmer_valid = !ref_freq_kmer_bitmask[ref_offset + i]; // check if the kmer should be discarded
+		const minhash_t kmer_hash = params->kmer_hasher->encrypt_packed_kmer(m.kmer_iter.packed());
+		minhash_rolling_push(m, kmer_hash, kmer_valid, params->h, min_hashes);
+		any_valid_kmers |= kmer_valid;
 	}
 
 	if(!any_valid_kmers) {
@@ -175,45 +477,106 @@ bool minhash_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_le
 					const index_params_t* params,
 					VectorMinHash& min_hashes) {
 
-	minhash_t new_kmer_hash = 0;
-	bool new_kmer_hash_valid = false;
-	seq_t last_kmer_pos = ref_offset + seq_len - params->k;
-	if(!ref_freq_kmer_bitmask[last_kmer_pos]) { // check if the kmer should be discarded
-		new_kmer_hash_valid = true;
-		new_kmer_hash = CityHash32(&seq[last_kmer_pos], params->k);
-	}
+	// the windows are consecutive: the new kmer follows the last kmer of the previous window
+	rolling_minhash_matrix.kmer_iter.next();
+	const seq_t last_kmer_pos = ref_offset + seq_len - params->k;
+	const bool kmer_valid = !ref_freq_kmer_bitmask[last_kmer_pos]; // check if the kmer should be discarded
+	const minhash_t kmer_hash = params->kmer_hasher->encrypt_packed_kmer(rolling_minhash_matrix.kmer_iter.packed());
+	minhash_rolling_push(rolling_minhash_matrix, kmer_hash, kmer_valid, params->h, min_hashes);
+
 	bool any_valid_kmers = false;
 	for(uint32 h = 0; h < params->h; h++) {
-		minhash_t min_h = UINT_MAX;
-		if(new_kmer_hash_valid) {
-			const rand_hash_function_t* f = &params->minhash_functions[h];
-			min_h = f->apply(new_kmer_hash);
-		}
-		// if less than current min, update min, populate oldest column
-		if(min_h < min_hashes[h]) {
-			min_hashes[h] = min_h;
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-		} else if(rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] != min_hashes[h]) {
-			// if the minimum doesn't come from the old column, no need to recompute
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-		} else {
-			// need to recompute the minimum
-			min_hashes[h] = UINT_MAX;
-			rolling_minhash_matrix.h_minhash_cols[rolling_minhash_matrix.oldest_col_index][h] = min_h;
-			for(uint32 i = 0; i < seq_len - params->k + 1; i++) {
-				if(rolling_minhash_matrix.h_minhash_cols[i][h] < min_hashes[h]) {
-					min_hashes[h] = rolling_minhash_matrix.h_minhash_cols[i][h];
-				}
-			}
-		}
 		if(min_hashes[h] != UINT_MAX) {
 			any_valid_kmers = true;
 		}
 	}
-	rolling_minhash_matrix.oldest_col_index = (rolling_minhash_matrix.oldest_col_index + 1) % (seq_len - params->k + 1);
 	return any_valid_kmers;
 }
 
+// pushes the next kmer of the window into the ring, replacing the oldest one
+inline void oph_rolling_push(minhash_matrix_t& m, const minhash_t kmer_hash, const bool kmer_valid, const uint32 n_bins) {
+	const minhash_t v = kmer_valid ? kmer_hash : UINT_MAX;
+	const uint32 slot = m.oph_ring_pos;
+	const minhash_t v_old = m.oph_ring[slot];
+	m.oph_ring[slot] = v;
+	m.oph_ring_pos = (slot + 1 == m.n_block_cols) ? 0 : slot + 1;
+	if(v_old != UINT_MAX) {
+		m.oph_n_valid--;
+		// the minimum of the bin left the window: rescan the window for the bin
+		// (the bins are ranges of hash values, so its new minimum is the smallest value >= the start of the bin)
+		const uint32 b = oph_bin(v_old, n_bins);
+		if(m.oph_bin_min[b] == v_old) {
+			const minhash_t bin_start = (((uint64) b << 32) + n_bins - 1) / n_bins;
+			const minhash_t* __restrict ring = &m.oph_ring[0];
+			minhash_t bin_min = UINT_MAX;
+			#pragma omp simd reduction(min:bin_min)
+			for(uint32 i = 0; i < m.n_block_cols; i++) {
+				bin_min = std::min(bin_min, ring[i] >= bin_start ? ring[i] : (minhash_t) UINT_MAX);
+			}
+			m.oph_bin_min[b] = (bin_min != UINT_MAX && oph_bin(bin_min, n_bins) == b) ? bin_min : UINT_MAX;
+		}
+	}
+	if(v != UINT_MAX) {
+		m.oph_n_valid++;
+		const uint32 b = oph_bin(v, n_bins);
+		m.oph_bin_min[b] = std::min(m.oph_bin_min[b], v);
+	}
+}
+
+bool oph_rolling_init(const char* seq, const seq_t ref_offset, const seq_t seq_len,
+					minhash_matrix_t& rolling_minhash_matrix,
+					const VectorBool& ref_freq_kmer_bitmask,
+					const index_params_t* params,
+					VectorMinHash& min_hashes) {
+
+	minhash_matrix_t& m = rolling_minhash_matrix;
+	m.n_block_cols = seq_len - params->k + 1;
+	m.oph_ring.assign(m.n_block_cols, UINT_MAX);
+	m.oph_bin_min.assign(params->h, UINT_MAX);
+	m.oph_ring_pos = 0;
+	m.oph_n_valid = 0;
+	m.kmer_iter = kmer_iter_t(seq, params->k);
+
+	for(uint32 i = 0; i < m.n_block_cols; i++) {
+		if(i == 0) {
+			m.kmer_iter.reset(ref_offset);
+		} else {
+			m.kmer_iter.next();
+		}
+		const bool kmer_valid = !ref_freq_kmer_bitmask[ref_offset + i]; // check if the kmer should be discarded
+		const minhash_t kmer_hash = params->kmer_hasher->encrypt_packed_kmer(m.kmer_iter.packed());
+		oph_rolling_push(m, kmer_hash, kmer_valid, params->h);
+	}
+
+	if(m.oph_n_valid == 0) {
+		std::fill(min_hashes.begin(), min_hashes.end(), UINT_MAX);
+		return false;
+	}
+	oph_densify(&m.oph_bin_min[0], params->h, &min_hashes[0]);
+	return true;
+}
+
+bool oph_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_len,
+					minhash_matrix_t& rolling_minhash_matrix,
+					const VectorBool& ref_freq_kmer_bitmask,
+					const index_params_t* params,
+					VectorMinHash& min_hashes) {
+
+	minhash_matrix_t& m = rolling_minhash_matrix;
+	m.kmer_iter.next();
+	const seq_t last_kmer_pos = ref_offset + seq_len - params->k;
+	const bool kmer_valid = !ref_freq_kmer_bitmask[last_kmer_pos]; // check if the kmer should be discarded
+	const minhash_t kmer_hash = params->kmer_hasher->encrypt_packed_kmer(m.kmer_iter.packed());
+	oph_rolling_push(m, kmer_hash, kmer_valid, params->h);
+
+	if(m.oph_n_valid == 0) {
+		std::fill(min_hashes.begin(), min_hashes.end(), UINT_MAX);
+		return false;
+	}
+	oph_densify(&m.oph_bin_min[0], params->h, &min_hashes[0]);
+	return true;
+}
+
 /////////////////////////
 // --- LSH: simhash ---
 
@@ -12,15 +12,49 @@
 // LSH schemes
 
 // rolling min-hash structure
+// sliding window minimum (van Herk/Gil-Werman): the kmers are split into blocks of window length,
+// the minimum of a window is the min of the suffix minimum of the previous block and
+// the prefix minimum of the current block;
+// all the arrays are h-contiguous (the values of the h hash functions of a kmer are adjacent)
 struct minhash_matrix_t {
-	std::vector<VectorMinHash> h_minhash_cols;
-	uint32 oldest_col_index;
+	VectorMinHash block_cols;		// hash values of the kmers of the current block
+	VectorMinHash prev_suffix_min;	// suffix minima of the previous block (+ a last column of UINT_MAX)
+	VectorMinHash prefix_min;		// prefix minimum of the current block
+	VectorMinHash hash_mult;		// multipliers of the min-hash functions
+	uint32 n_block_cols;			// number of kmers in a block (window)
+	uint32 block_pos;				// position of the next kmer in the current block
+	kmer_iter_t kmer_iter;			// last kmer of the window
+
+	// one-permutation min-hash (OPH): the kmer hashes of the window are kept in a ring
+	// and each bin tracks its minimum (the bin is rescanned when its minimum leaves the window)
+	VectorMinHash oph_ring;			// hash values of the window kmers (UINT_MAX for the discarded kmers)
+	VectorMinHash oph_bin_min;		// minimum of each bin over the window
+	uint32 oph_ring_pos;			// ring slot of the oldest kmer of the window
+	uint32 oph_n_valid;				// number of valid kmers in the window
+};
+
+// multi-ISA min-hash kernel (selected at startup from the cpu features)
+// the kmer hash buffer must have room for MINHASH_KERNEL_PAD values past the last kmer (they are overwritten)
+#define MINHASH_KERNEL_PAD 16
+typedef void (*minhash_kernel_t)(minhash_t* kmer_hashes, const uint32 n_kmers, const VectorHashFunctions& funcs, const uint32 n_funcs, minhash_t* min_hashes);
+struct minhash_kernel_info_t {
+	const char* name;
+	const char* cpu_feature;	// required cpu feature (NULL for the portable kernel)
+	minhash_kernel_t run;
 };
+extern const minhash_kernel_info_t minhash_kernels[];
+extern const uint32 n_minhash_kernels;
+extern const minhash_kernel_info_t* minhash_kernel;
+bool minhash_kernel_supported(const minhash_kernel_info_t& kernel);
 
+void minhash_sketch(minhash_t* kmer_hashes, const uint32 n_kmers, const index_params_t* params,
+		minhash_t* bins, minhash_t* min_hashes);
+void oph_sketch(const minhash_t* kmer_hashes, const uint32 n_kmers, const uint32 n_bins,
+		minhash_t* bins, minhash_t* min_hashes);
 void minhash_set(std::vector<minhash_t> encrypted_kmers, const index_params_t* params, VectorMinHash& min_hashes);
 
 bool minhash(const char* seq, const seq_t seq_len,
-		const VectorBool& ref_freq_kmer_bitmask,
+		const freq_kmer_filter_t& ref_freq_kmer_filter,
 		const MarisaTrie& ref_freq_kmer_trie,
 		const MarisaTrie& reads_hist,
 		const index_params_t* params,
@@ -35,6 +69,16 @@ bool minhash_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_le
 		const VectorBool& ref_freq_kmer_bitmask,
 		const index_params_t* params,
 		VectorMinHash& min_hashes);
+bool oph_rolling_init(const char* seq, const seq_t ref_offset, const seq_t seq_len,
+		minhash_matrix_t& rolling_minhash_matrix,
+		const VectorBool& ref_freq_kmer_bitmask,
+		const index_params_t* params,
+		VectorMinHash& min_hashes);
+bool oph_rolling(const char* seq, const seq_t ref_offset, const seq_t seq_len,
+		minhash_matrix_t& rolling_minhash_matrix,
+		const VectorBool& ref_freq_kmer_bitmask,
+		const index_params_t* params,
+		VectorMinHash& min_hashes);
 
 hash_t simhash(const char* seq, const seq_t seq_offset, const seq_t seq_len,
 		const MapKmerCounts& ref_hist, const MapKmerCounts& reads_hist,
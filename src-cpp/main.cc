@@ -35,18 +35,26 @@
 #include <string.h>
 #include "index.h"
 #include "align.h"
+#include "lsh.h"
 
 void print_usage(index_params_t* params) {
-	printf("Usage: ./balaur [options] <index|align> <ref.fa> <reads.fq> \n");
+	printf("Usage: ./balaur [options] <index|align|bench> <ref.fa> <reads.fq> \n");
 	printf("Hashing options:\n\n");
 	printf("       -h        number of hash functions for MinHash fingerprint construction (i.e. fingerprint length) [%d]\n", params->h);
 	printf("       -T        number of hash tables [%d]\n", params->n_tables);
 	printf("       -k        length of the sequence kmers [%d]\n", params->k);
 	printf("       -b        length of the fingerprint projections [%d]\n", params->sketch_proj_len);
+	printf("       -O        use one-permutation MinHash with densification for the fingerprints (one hash per kmer instead of h); in align mode it selects the default OPH index file [OFF]\n");
 	printf("\nIndex-only options:\n\n");
 	printf("       -w        length of the reference windows to hash (should be set to the expected read length for optimal results) [%d]\n", params->ref_window_size);
 	printf("       -H        upper bound on kmer occurrence in the reference [%llu]\n", params->max_count);
+	printf("       -F        high-frequency kmer filter: 0 - auto (by number of kmers), 1 - sorted array, 2 - blocked Bloom filter, 3 - bitmap [%d]\n", params->freq_filter);
+	printf("       -R        memory budget for counting the reference kmers when <ref.fa>.kmer_hist is missing, in MB (0 - half of the physical memory) [%u]\n", params->kmer_count_mem_mb);
 	printf("       -s        initially allocated hash table bucket size [%d]\n", params->bucket_size);
+	printf("       -C        store the index buckets in the packed (delta/varint compressed) layout [OFF]\n");
+	printf("       -A        store the index buckets in the SoA layout (separate hash and pos/len columns) [OFF]\n");
+	printf("       -D        store a directory of the distinct hashes in each bucket to speed up the bucket lookups (flat layout only) [OFF]\n");
+	printf("       -o        output index file [<ref.fa>.idx.<params>]\n");
 	printf("\nAlignment-only options:\n\n");
 	printf("       -m        minimum required number of buckets shared between a reference window and the read for a contig to be examined [%d]\n", params->min_n_hits);
 	printf("       -N        maximum distance from the best number of shared buckets found for a contig to be examined [%d]\n", params->dist_best_hit);
@@ -57,6 +65,10 @@ void print_usage(index_params_t* params) {
 	printf("       -x        delta multiplier for the second RANSAC pass (i.e. number of deltas away the second position must be from the first pass median) [%d]\n", params->delta_x);
 	printf("       -c        cutoff minimum number of inlier votes [dynamic]\n");
 	printf("       -S        disable votes scaling [ON]\n");
+	printf("       -i        index file to align against (index parameters and hash functions are read from the index) [<ref.fa>.idx.<params>]\n");
+	printf("       -V        verify the index data and reference checksums on load [OFF]\n");
+	printf("       -M        prefetch mode for the mapped index file: 0 - none, 1 - MAP_POPULATE, 2 - madvise(WILLNEED) [%d]\n", params->idx_prefetch);
+	printf("       -B        stream the reads in batches of this many reads, bounding the memory used by the reads (0 - load all the reads at once) [%u]\n", params->read_batch_size);
 	printf("\nOther options:\n\n");
 	printf("       -t        number of threads [%d]\n", params->n_threads);
 }
@@ -70,7 +82,7 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 	int c;
-	while ((c = getopt(argc-1, argv+1, "i:o:w:k:h:L:H:T:b:p:l:t:m:s:d:v:PN:n:c:Sx:f:z:e:I:")) >= 0) {
+	while ((c = getopt(argc-1, argv+1, "i:o:w:k:h:L:H:T:b:p:l:t:m:s:d:v:PN:n:c:Sx:f:z:e:I:M:VCDAF:R:B:O")) >= 0) {
 		switch (c) {
 			case 'h': params.h = atoi(optarg); break;
 			case 'T': params.n_tables = atoi(optarg); break;
@@ -98,6 +110,15 @@ int main(int argc, char *argv[]) {
 			case 'z': params.precomp_contig_file_name = std::string(optarg); break;
 			case 'e': params.kmer_hashing_alg = (kmer_hash_alg) atoi(optarg); break;
 			case 'I': params.sampling_intv = atoi(optarg); break;
+			case 'V': params.verify_index = true; break;
+			case 'C': params.layout = IDX_LAYOUT_PACKED; break;
+			case 'D': params.hash_dir = true; break;
+			case 'A': params.layout = IDX_LAYOUT_SOA; break;
+			case 'M': params.idx_prefetch = (idx_prefetch_mode) atoi(optarg); break;
+			case 'F': params.freq_filter = (freq_filter_type) atoi(optarg); break;
+			case 'R': params.kmer_count_mem_mb = atoi(optarg); break;
+			case 'B': params.read_batch_size = atoi(optarg); break;
+			case 'O': params.alg = OPH; break;
 			default: return 0;
 		}
 	}
@@ -107,7 +128,6 @@ int main(int argc, char *argv[]) {
 	params.n_buckets = pow(2, params.n_buckets_pow2);
 	if (strcmp(argv[1], "index") == 0) {
 		printf("Mode: Indexing \n");
-		params.alg = MINH; // only minhash enabled for now
 		params.set_kmer_hash_function();
 		params.set_minhash_hash_function();
 		params.set_minhash_sketch_hash_function();
@@ -119,11 +139,13 @@ int main(int argc, char *argv[]) {
 
 	} else if (strcmp(argv[1], "align") == 0) {
 		printf("Mode: Alignment \n");
-		params.alg = MINH; // only minhash enabled for now
+		printf("MinHash kernel: %s \n", minhash_kernel->name);
 		params.set_kmer_hash_function();
-		params.set_minhash_hash_function();
-		params.set_minhash_sketch_hash_function();
-		params.generate_sparse_sketch_projections();
+		if(!load_ref_idx_params(argv[optind+1], &params)) {
+			printf("Index file %s not found, run index first!\n", ref_idx_fname(argv[optind+1], &params).c_str());
+			exit(1);
+		}
+		printf("Fingerprint scheme: %s \n", params.alg == OPH ? "one-permutation MinHash" : "MinHash");
 		params.load_mhi = false;
 		params.monolith = false;
 
@@ -136,23 +158,20 @@ int main(int argc, char *argv[]) {
 		ref_t ref;
 		load_index_ref_lsh(argv[optind+1], &params, ref);
 
-		// 2. load the reads
-		reads_t reads;
-		fastq2reads(argv[optind+2], reads);
+		// 2. load the reads (one batch at a time) and align
+		balaur_main(argv[optind+1], argv[optind+2], ref, &params);
 
-		// 3. align
-		balaur_main(argv[optind+1], ref, reads, &params);
+	} else if (strcmp(argv[1], "bench") == 0) {
+		printf("Mode: MinHash kernel benchmark \n");
+		params.set_kmer_hash_function();
+		minhash_kernel_bench(argv[optind+1], argv[optind+2], &params);
 
 	} else if (strcmp(argv[1], "stats") == 0) {
 		printf("Mode: STATS \n");
 		
-		//ref_t ref;
-		//load_ref_idx(argv[optind+1], ref, &params);
-		//store_ref_idx_flat(argv[optind+1], ref, &params);
-
 		// load the reference index
 		ref_t ref;
-		fasta2ref(argv[optind+1], ref);
+		load_packed_ref(argv[optind+1], ref);
 		load_kmer2_hashes(argv[optind+1], ref, &params);
 		//compute_store_repeat_info(argv[optind+1], ref, &params);
 		compute_store_repeat_local(argv[optind+1], ref, &params);		
@@ -0,0 +1,117 @@
+#ifndef PACKED_SEQ_H_
+#define PACKED_SEQ_H_
+
+#pragma once
+
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include "types.h"
+
+#define PACKED_SEQ_BASES_PER_WORD 32
+#define PACKED_SEQ_AMBIG_BASE 4
+
+// run of ambiguous bases (N)
+struct n_run_t {
+	seq_t start;
+	seq_t len;
+};
+
+// 2-bit packed nucleotide sequence (nt4 encoding: A=0, G=1, C=2, T=3)
+// 32 bases per word, the first base in the low bits;
+// the ambiguous bases are packed as A and listed in sorted, disjoint runs
+// (the arrays point either into the owned buffers or into a mapped reference cache file)
+struct packed_seq_t {
+	const uint64* words;
+	const n_run_t* n_runs;
+	uint64 n_words;
+	uint64 n_n_runs;
+	seq_t len;
+
+	// owned storage
+	std::vector<uint64> words_buf;
+	std::vector<n_run_t> n_runs_buf;
+
+	// mapped reference cache file
+	void* mmap_addr;
+	size_t mmap_len;
+
+	packed_seq_t() : words(NULL), n_runs(NULL), n_words(0), n_n_runs(0), len(0), mmap_addr(NULL), mmap_len(0) {}
+
+	// point the arrays to the owned buffers
+	void attach_buffers() {
+		words = words_buf.data();
+		n_words = words_buf.size();
+		n_runs = n_runs_buf.data();
+		n_n_runs = n_runs_buf.size();
+	}
+
+	void release() {
+		if(mmap_addr != NULL) {
+			munmap(mmap_addr, mmap_len);
+			mmap_addr = NULL;
+			mmap_len = 0;
+		}
+		std::vector<uint64>().swap(words_buf);
+		std::vector<n_run_t>().swap(n_runs_buf);
+		words = NULL;
+		n_runs = NULL;
+		n_words = 0;
+		n_n_runs = 0;
+		len = 0;
+	}
+
+	uint64 size_bytes() const {
+		return n_words*sizeof(uint64) + n_n_runs*sizeof(n_run_t);
+	}
+
+	// index of the first run that ends after the given position
+	inline uint64 first_n_run(const seq_t pos) const {
+		uint64 lo = 0, hi = n_n_runs;
+		while(lo < hi) {
+			const uint64 mid = lo + (hi - lo)/2;
+			if(n_runs[mid].start + n_runs[mid].len <= pos) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	// nt4 code of the base at the given position
+	inline char base(const seq_t pos) const {
+		const uint64 r = first_n_run(pos);
+		if(r < n_n_runs && n_runs[r].start <= pos) {
+			return PACKED_SEQ_AMBIG_BASE;
+		}
+		return (words[pos / PACKED_SEQ_BASES_PER_WORD] >> (2*(pos % PACKED_SEQ_BASES_PER_WORD))) & 3;
+	}
+
+	// unpacks n bases starting at the given position into nt4 codes
+	void unpack(const seq_t pos, const seq_t n, char* out) const {
+		const uint8* bytes = reinterpret_cast<const uint8*>(words); // 4 bases per byte (little-endian words)
+		seq_t i = pos;
+		const seq_t end = pos + n;
+		for(; i < end && (i & 3) != 0; i++) {
+			out[i - pos] = (bytes[i >> 2] >> (2*(i & 3))) & 3;
+		}
+		for(; i + 4 <= end; i += 4) {
+			const uint8 b = bytes[i >> 2];
+			out[i - pos] = b & 3;
+			out[i - pos + 1] = (b >> 2) & 3;
+			out[i - pos + 2] = (b >> 4) & 3;
+			out[i - pos + 3] = b >> 6;
+		}
+		for(; i < end; i++) {
+			out[i - pos] = (bytes[i >> 2] >> (2*(i & 3))) & 3;
+		}
+		for(uint64 r = first_n_run(pos); r < n_n_runs && n_runs[r].start < end; r++) {
+			const seq_t run_start = std::max(n_runs[r].start, pos);
+			const seq_t run_end = std::min(n_runs[r].start + n_runs[r].len, end);
+			memset(&out[run_start - pos], PACKED_SEQ_AMBIG_BASE, run_end - run_start);
+		}
+	}
+};
+
+#endif /*PACKED_SEQ_H_*/
@@ -2,8 +2,8 @@
 
 void print_aln2sam(FILE* samFile, read_t* r, const ref_t& ref);
 
-void store_alns_sam(reads_t& reads, const ref_t& ref, const index_params_t* params) {
-	std::string samFname(reads.fname);
+FILE* open_sam_file(const char* readsFname) {
+	std::string samFname(readsFname);
 	samFname += std::string(".sam");
 
 	FILE* samFile = (FILE*) fopen(samFname.c_str(), "w");
@@ -11,12 +11,15 @@ void store_alns_sam(reads_t& reads, const ref_t& ref, const index_params_t* para
 		printf("alns2sam: Cannot open SAM file: %s!\n", samFname.c_str());
 		exit(1);
 	}
+	return samFile;
+}
 
+// appends the alignments of the reads to the SAM file
+void store_alns_sam(FILE* samFile, read_batch_t& reads, const ref_t& ref, const index_params_t* params) {
 	for (uint32 i = 0; i < reads.reads.size(); i++) {
 		read_t* r = &reads.reads[i];
 		print_aln2sam(samFile, r, ref);
 	}
-	fclose(samFile);
 }
 
 #define SAM_FSU   4 // self-unmapped
@@ -46,9 +49,9 @@ void print_aln2sam(FILE* samFile, read_t* r, const ref_t& ref) {
 
 		// QNAME, FLAG, RNAME
 		if(r->seq_id+1 <= 22) {
-			fprintf(samFile, "%s\t%d\t%d\t", r->name.c_str(), flag, r->seq_id+1);
+			fprintf(samFile, "%s\t%d\t%d\t", r->name, flag, r->seq_id+1);
 		} else {
-			fprintf(samFile, "%s\t%d\tX\t", r->name.c_str(), flag);
+			fprintf(samFile, "%s\t%d\tX\t", r->name, flag);
 		}
 
 		// POS (1-based), MAPQ
@@ -61,7 +64,7 @@ void print_aln2sam(FILE* samFile, read_t* r, const ref_t& ref) {
 		fprintf(samFile, "\t*\t0\t0\t");
 
 		// SEQ, QUAL (print sequence and quality)
-		const char* seq = r->top_aln.rc ? r->rc.c_str() : r->seq.c_str();
+		const char* seq = r->top_aln.rc ? r->rc : r->seq;
 		for (uint32 i = 0; i != r->len; i++) {
 			fprintf(samFile, "%c", "AGCTN"[(int)seq[i]]);
 		}
@@ -73,7 +76,7 @@ void print_aln2sam(FILE* samFile, read_t* r, const ref_t& ref) {
 	} else { // unmapped read
 		int flag = SAM_FSU;
 		// QNAME, FLAG
-		fprintf(samFile, "%s\t%d\t*\t0\t0\t*\t*\t0\t0\t", r->name.c_str(), flag);
+		fprintf(samFile, "%s\t%d\t*\t0\t0\t*\t*\t0\t0\t", r->name, flag);
 
 		// SEQ, QUAL (print sequence and quality)
 		for (uint32 i = 0; i != r->len; i++) {
@@ -3,6 +3,7 @@
 
 #include "index.h"
 
-void store_alns_sam(reads_t& reads, const ref_t& ref, const index_params_t* params);
+FILE* open_sam_file(const char* readsFname);
+void store_alns_sam(FILE* samFile, read_batch_t& reads, const ref_t& ref, const index_params_t* params);
 
 #endif
@@ -6,9 +6,12 @@
 #include <omp.h>
 #include <fstream>
 #include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "types.h"
 #include "io.h"
 #include "hash.h"
+#include "lsh.h"
 
 // K-Mer stats //
 
@@ -41,35 +44,59 @@ void load_freq_kmers(const char* refFname, std::set<uint64>& freq_kmers, const i
 	printf("Filtered %u kmers\n", filtered);
 }
 
-void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, MarisaTrie& freq_trie, const uint32 max_count_threshold) {
+std::string freq_kmer_filter_fname(const char* refFname, const index_params_t* params) {
+	std::string fname(refFname);
+	fname += std::string(".kmer_filter.H");
+	fname += std::to_string(params->max_count);
+	return fname;
+}
+
+// loads the high-frequency kmer filter
+// the filter is built from the kmer histogram and cached in <ref>.kmer_filter.H<max_count>
+void load_freq_kmers(const char* refFname, freq_kmer_filter_t& freq_filter, MarisaTrie& freq_trie, const index_params_t* params) {
 	std::string fname(refFname);
 	fname += std::string(".kmer_hist");
+	const std::string filter_fname = freq_kmer_filter_fname(refFname, params);
+
+	struct stat st;
+	if(stat(fname.c_str(), &st) != 0) {
+		printf("load_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
+		exit(1);
+	}
+#if(!USE_MARISA)
+	if(freq_filter.load(filter_fname, params->max_count, st, params->freq_filter)) {
+		printf("Loaded %llu frequent kmers (%s, %.2f MB) from %s \n", freq_filter.n_kmers,
+				freq_filter_type_name(freq_filter.type), (float) freq_filter.size_bytes()/(1 << 20), filter_fname.c_str());
+		return;
+	}
+#endif
 
 	std::ifstream file;
 	file.open(fname.c_str(), std::ios::in | std::ios::binary);
-
 	if (!file.is_open()) {
 		printf("load_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
 		exit(1);
 	}
-	freq_kmers_bitmap.resize(UINT_MAX + 1L);
-	uint32 kmer, count;
-	uint32 filtered = 0;
-	uint32 tot_filtered = 0;
-	int map_size;
+	// the histogram is the number of entries followed by the (kmer, count) pairs
+	uint32 map_size = 0;
 	file.read(reinterpret_cast<char*>(&map_size), sizeof(map_size));
+	std::vector<uint32> hist(2*(uint64) map_size);
+	file.read(reinterpret_cast<char*>(hist.data()), hist.size()*sizeof(uint32));
+	if(!file) {
+		printf("load_kmer_hist: Hist file %s is truncated!\n", fname.c_str());
+		exit(1);
+	}
+	file.close();
+
+	std::vector<uint32> freq_kmers;
 #if(USE_MARISA)
 	marisa::Keyset keys;
 #endif
-	while(map_size >= 0) {
-		file.read(reinterpret_cast<char*>(&kmer), sizeof(kmer));
-		file.read(reinterpret_cast<char*>(&count), sizeof(count));
-		if(count >= max_count_threshold) {
-			tot_filtered++;
-			//if (!kmer_has_zero(kmer)) {
-			freq_kmers_bitmap[kmer] = true;
-			filtered++;
-			//}
+	for(uint64 i = 0; i < map_size; i++) {
+		const uint32 kmer = hist[2*i];
+		const uint32 count = hist[2*i + 1];
+		if(count >= params->max_count) {
+			freq_kmers.push_back(kmer);
 #if(USE_MARISA)
 			unsigned char* seq = (unsigned char*) malloc(17*sizeof(char));
 			unpack_32(kmer, seq, 16);
@@ -78,19 +105,20 @@ void load_freq_kmers(const char* refFname, VectorBool& freq_kmers_bitmap, Marisa
 			free(seq);
 #endif
 		}
-		map_size--;
 	}
 #if(USE_MARISA)
 	freq_trie.build(keys, 0);
 #endif
-	file.close();
-	printf("Filtered %u kmers, tot %u \n", filtered, tot_filtered);
+	freq_filter.build(freq_kmers, params->freq_filter);
+	freq_filter.store(filter_fname, params->max_count, st);
+	printf("Filtered %llu kmers (%s, %.2f MB) \n", freq_filter.n_kmers,
+			freq_filter_type_name(freq_filter.type), (float) freq_filter.size_bytes()/(1 << 20));
 }
 
 // compute and store the frequency of each kmer in the given sequence (up to length 32)
 void compute_and_store_kmer_hist32(const char* refFname, const char* seq, const seq_t seq_len, const index_params_t* params) {
 	std::vector<uint64> kmers(seq_len - params->k + 1);
-	#pragma omp parallel
+	#pragma omp parallel for
 	for(seq_t j = 0; j < seq_len - params->k + 1; j++) {
 			pack_64(&seq[j], params->k, &(kmers[j]));
 	}
@@ -140,32 +168,178 @@ void compute_and_store_kmer_hist32(const char* refFname, const char* seq, const
     std::cout << "Total number of unique kmers " << unique << " out of " << kmers.size() << "\n";
 }
 
-// compute and store the frequency of each kmer in the given sequence (up to length 16)
-void compute_and_store_kmer_hist16(const char* refFname, const char* seq, const seq_t seq_len, const index_params_t* params) {
-	std::map<uint32, seq_t> hist;
-	for(seq_t j = 0; j < seq_len - params->k + 1; j++) {
-		uint32_t kmer;
-		if(pack_32(&seq[j], params->k, &kmer) < 0) {
-			continue;
+#define KMER_HIST_PART_BITS 8 // the kmers are partitioned on their high bits
+#define KMER_HIST_N_PARTS (1 << KMER_HIST_PART_BITS)
+#define KMER_HIST_CHUNK_SIZE (1 << 20)
+
+// returns the memory budget for the kmer partitions in bytes
+uint64 kmer_hist_mem_budget(const index_params_t* params) {
+	if(params->kmer_count_mem_mb != 0) {
+		return (uint64) params->kmer_count_mem_mb << 20;
+	}
+	return (uint64) sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGE_SIZE)/2;
+}
+
+// compute and store the frequency of each kmer in the reference (up to length 16)
+// and the filter of the high-frequency kmers
+// - the kmers are radix-partitioned on their high bits, the number of kmers of each partition
+// in each reference chunk is counted first
+// - groups of consecutive partitions that fit in the memory budget are scattered into place
+// (rescanning the reference for each group), then each partition is sorted and counted independently
+// - only the kmers occurring more than once are stored in the histogram
+void compute_store_kmer_hist(const char* refFname, const ref_t& ref, const index_params_t* params) {
+	double start_time = omp_get_wtime();
+	const seq_t n_kmers = ref.len - params->k + 1;
+	const uint32 n_chunks = (n_kmers + KMER_HIST_CHUNK_SIZE - 1)/KMER_HIST_CHUNK_SIZE;
+	const uint32 part_shift = BITS_IN_WORD - KMER_HIST_PART_BITS;
+
+	// 1. count the kmers of each partition in each chunk
+	std::vector<uint64> chunk_part_counts((uint64) n_chunks*KMER_HIST_N_PARTS);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for(uint32 c = 0; c < n_chunks; c++) {
+		const seq_t chunk_start = c*KMER_HIST_CHUNK_SIZE;
+		const seq_t chunk_end = std::min(chunk_start + KMER_HIST_CHUNK_SIZE, n_kmers);
+		uint64* counts = &chunk_part_counts[(uint64) c*KMER_HIST_N_PARTS];
+		kmer_iter_t kmer_iter(ref.seq.c_str(), params->k);
+		kmer_iter.reset(chunk_start);
+		for(seq_t i = chunk_start; i < chunk_end; i++) {
+			if(i != chunk_start) {
+				kmer_iter.next();
+			}
+			if(kmer_iter.valid()) {
+				counts[kmer_iter.packed() >> part_shift]++;
+			}
 		}
-		hist[kmer]++;
 	}
+	std::vector<uint64> part_sizes(KMER_HIST_N_PARTS);
+	for(uint32 c = 0; c < n_chunks; c++) {
+		for(uint32 p = 0; p < KMER_HIST_N_PARTS; p++) {
+			part_sizes[p] += chunk_part_counts[(uint64) c*KMER_HIST_N_PARTS + p];
+		}
+	}
+
 	std::string fname(refFname);
 	fname += std::string(".kmer_hist");
-	fname += std::to_string(params->k);
 	std::ofstream file;
 	file.open(fname.c_str(), std::ios::out | std::ios::binary);
 	if (!file.is_open()) {
-		printf("compute_and_store_kmer_hist16: Cannot open the hist file %s!\n", fname.c_str());
+		printf("compute_store_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
 		exit(1);
 	}
-	uint32 map_size = hist.size();
+	uint32 map_size = 0; // written once all the partitions are counted
 	file.write(reinterpret_cast<char*>(&map_size), sizeof(map_size));
-	for (std::map<uint32, seq_t>::const_iterator it = hist.begin(); it != hist.end(); ++it) {
-		file.write(reinterpret_cast<const char*>(&(it->first)), sizeof(it->first));
-		file.write(reinterpret_cast<const char*>(&(it->second)), sizeof(it->second));
+
+	const uint64 max_group_size = kmer_hist_mem_budget(params)/sizeof(uint32);
+	std::vector<uint32> freq_kmers;
+	std::vector<uint32> part_kmers;
+	std::vector<std::vector<uint32>> part_hists(KMER_HIST_N_PARTS);
+	std::vector<std::vector<uint32>> part_freq_kmers(KMER_HIST_N_PARTS);
+	uint32 n_groups = 0;
+	uint64 n_unique = 0;
+	for(uint32 first_part = 0; first_part < KMER_HIST_N_PARTS; n_groups++) {
+		// 2. select the next group of partitions (at least one)
+		uint32 last_part = first_part;
+		uint64 group_size = part_sizes[first_part];
+		while(last_part + 1 < KMER_HIST_N_PARTS && group_size + part_sizes[last_part + 1] <= max_group_size) {
+			last_part++;
+			group_size += part_sizes[last_part];
+		}
+		const uint32 n_group_parts = last_part - first_part + 1;
+
+		// offsets of the kmers of each chunk in each partition of the group
+		std::vector<uint64> chunk_part_offsets((uint64) n_chunks*n_group_parts);
+		uint64 offset = 0;
+		for(uint32 p = 0; p < n_group_parts; p++) {
+			for(uint32 c = 0; c < n_chunks; c++) {
+				chunk_part_offsets[(uint64) c*n_group_parts + p] = offset;
+				offset += chunk_part_counts[(uint64) c*KMER_HIST_N_PARTS + first_part + p];
+			}
+		}
+		std::vector<uint64> part_offsets(n_group_parts + 1);
+		for(uint32 p = 0; p < n_group_parts; p++) {
+			part_offsets[p] = chunk_part_offsets[p];
+		}
+		part_offsets[n_group_parts] = group_size;
+
+		// 3. scatter the kmers of the group partitions
+		part_kmers.resize(group_size);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for(uint32 c = 0; c < n_chunks; c++) {
+			const seq_t chunk_start = c*KMER_HIST_CHUNK_SIZE;
+			const seq_t chunk_end = std::min(chunk_start + KMER_HIST_CHUNK_SIZE, n_kmers);
+			uint64* cursors = &chunk_part_offsets[(uint64) c*n_group_parts];
+			kmer_iter_t kmer_iter(ref.seq.c_str(), params->k);
+			kmer_iter.reset(chunk_start);
+			for(seq_t i = chunk_start; i < chunk_end; i++) {
+				if(i != chunk_start) {
+					kmer_iter.next();
+				}
+				if(!kmer_iter.valid()) {
+					continue;
+				}
+				const uint32 kmer = kmer_iter.packed();
+				const uint32 p = kmer >> part_shift;
+				if(p >= first_part && p <= last_part) {
+					part_kmers[cursors[p - first_part]++] = kmer;
+				}
+			}
+		}
+
+		// 4. count the kmers of each partition
+		#pragma omp parallel for schedule(dynamic, 1) reduction(+:n_unique)
+		for(uint32 p = 0; p < n_group_parts; p++) {
+			std::vector<uint32>& hist = part_hists[first_part + p];
+			std::vector<uint32>& part_freq = part_freq_kmers[first_part + p];
+			uint32* kmers = &part_kmers[part_offsets[p]];
+			const uint64 n = part_offsets[p + 1] - part_offsets[p];
+			std::sort(kmers, kmers + n);
+			for(uint64 i = 0; i < n; ) {
+				uint64 j = i + 1;
+				while(j < n && kmers[j] == kmers[i]) {
+					j++;
+				}
+				const uint32 count = (uint32) std::min(j - i, (uint64) UINT_MAX);
+				if(count > 1) {
+					hist.push_back(kmers[i]);
+					hist.push_back(count);
+					if(count >= params->max_count) {
+						part_freq.push_back(kmers[i]);
+					}
+				} else {
+					n_unique++;
+				}
+				i = j;
+			}
+		}
+
+		// the partitions are stored in kmer order
+		for(uint32 p = first_part; p <= last_part; p++) {
+			file.write(reinterpret_cast<const char*>(part_hists[p].data()), part_hists[p].size()*sizeof(uint32));
+			map_size += part_hists[p].size()/2;
+			freq_kmers.insert(freq_kmers.end(), part_freq_kmers[p].begin(), part_freq_kmers[p].end());
+			std::vector<uint32>().swap(part_hists[p]);
+			std::vector<uint32>().swap(part_freq_kmers[p]);
+		}
+		first_part = last_part + 1;
 	}
+	std::vector<uint32>().swap(part_kmers);
+	file.seekp(0);
+	file.write(reinterpret_cast<char*>(&map_size), sizeof(map_size));
 	file.close();
+	struct stat hist_st;
+	if(stat(fname.c_str(), &hist_st) != 0) {
+		printf("compute_store_kmer_hist: Cannot open the hist file %s!\n", fname.c_str());
+		exit(1);
+	}
+
+	// the filter of the high-frequency kmers is emitted in the same pass
+	freq_kmer_filter_t freq_filter;
+	freq_filter.build(freq_kmers, params->freq_filter);
+	freq_filter.store(freq_kmer_filter_fname(refFname, params), params->max_count, hist_st);
+
+	printf("Counted %u repeated and %llu unique kmers in %u partition group(s), %llu frequent kmers (%s) \n",
+			map_size, n_unique, n_groups, freq_filter.n_kmers, freq_filter_type_name(freq_filter.type));
+	printf("Kmer histogram time: %.2f sec\n", omp_get_wtime() - start_time);
 }
 
 #define NUM_HIST_BUCKETS 1000000
@@ -427,10 +601,10 @@ void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_p
 	}
 
 	for(uint32 i = 0; i < params->n_tables; i++) {
-		const buckets_t& buckets = ref.mutable_index.per_table_buckets[i];
 		for(uint32 j = 0; j < params->n_buckets; j++) {
-			const VectorSeqPos& bucket = buckets.buckets_data_vectors[j];
-			uint32 size = bucket.size();
+			const uint64 bid = (uint64) i*params->n_buckets + j;
+			const loc_t* bucket = &ref.index.buckets_data[ref.index.bucket_offsets[bid]];
+			uint32 size = ref.index.bucket_offsets[bid+1] - ref.index.bucket_offsets[bid];
 			uint32 len_avg = 0;
 			for(uint32 k = 0; k < size; k++) {
 				len_avg += bucket[k].len;
@@ -453,3 +627,92 @@ void store_ref_index_stats(const char* refFname, const ref_t& ref, const index_p
 	}
 	file.close();
 }
+
+// ---- MinHash kernel benchmark ----
+// fingerprints the reads (forward strand) with each min-hash kernel supported by the cpu for h = 64 and 128
+// the kmer hashes are computed once (high-frequency kmers filtered as in the alignment), only the kernels are timed
+#define MINHASH_BENCH_PASSES 5
+void minhash_kernel_bench(const char* refFname, const char* readsFname, index_params_t* params) {
+	ref_t ref;
+	load_freq_kmers(refFname, ref.high_freq_kmer_filter, ref.high_freq_kmer_trie, params);
+	read_batch_t reads;
+	fastq2reads(readsFname, reads);
+
+	VectorMinHash kmer_hashes;
+	std::vector<uint64> read_offsets;
+	std::vector<uint32> read_n_kmers;
+	uint64 total_kmers = 0;
+	for(uint32 i = 0; i < reads.reads.size(); i++) {
+		const read_t* r = &reads.reads[i];
+		if(r->len < params->k) continue;
+		const uint64 offset = kmer_hashes.size();
+		kmer_iter_t kmer_iter(r->seq, params->k);
+		for(uint32 j = 0; j < r->len - params->k + 1; j++) {
+			if(j == 0) {
+				kmer_iter.reset(0);
+			} else {
+				kmer_iter.next();
+			}
+			if(!kmer_iter.valid() || ref.high_freq_kmer_filter.contains(kmer_iter.packed())) {
+				continue;
+			}
+			kmer_hashes.push_back(params->kmer_hasher->encrypt_packed_kmer(kmer_iter.packed()));
+		}
+		const uint32 n_kmers = kmer_hashes.size() - offset;
+		if(n_kmers == 0) continue;
+		kmer_hashes.resize(kmer_hashes.size() + MINHASH_KERNEL_PAD);
+		read_offsets.push_back(offset);
+		read_n_kmers.push_back(n_kmers);
+		total_kmers += n_kmers;
+	}
+	const uint32 n_reads = read_offsets.size();
+	if(n_reads == 0) {
+		printf("minhash_kernel_bench: No reads with valid kmers in %s!\n", readsFname);
+		exit(1);
+	}
+	printf("MinHash kernel benchmark: %u reads, %.1f kmers per read, selected kernel: %s \n",
+			n_reads, (float) total_kmers/n_reads, minhash_kernel->name);
+
+	const uint32 bench_h[2] = { 64, 128 };
+	for(uint32 b = 0; b < 2; b++) {
+		const uint32 h = bench_h[b];
+		VectorHashFunctions funcs(h);
+		VectorMinHash ref_min_hashes(n_reads*h);
+		VectorMinHash min_hashes(n_reads*h);
+		// the portable kernel is the last one: its output is the reference for the others
+		for(int k = n_minhash_kernels - 1; k >= 0; k--) {
+			const minhash_kernel_info_t& kernel = minhash_kernels[k];
+			if(!minhash_kernel_supported(kernel)) {
+				printf("h = %u: %-7s not supported by the cpu \n", h, kernel.name);
+				continue;
+			}
+			double best_time = 0;
+			for(uint32 p = 0; p < MINHASH_BENCH_PASSES; p++) {
+				double start_time = omp_get_wtime();
+				for(uint32 i = 0; i < n_reads; i++) {
+					kernel.run(&kmer_hashes[read_offsets[i]], read_n_kmers[i], funcs, h, &min_hashes[(uint64) i*h]);
+				}
+				const double t = omp_get_wtime() - start_time;
+				if(p == 0 || t < best_time) best_time = t;
+			}
+			if(k == (int) n_minhash_kernels - 1) {
+				ref_min_hashes.swap(min_hashes);
+			}
+			const bool match = (k == (int) n_minhash_kernels - 1) || (min_hashes == ref_min_hashes);
+			printf("h = %u: %-7s %8.1f ns/read %8.2f M reads/sec %s\n", h, kernel.name, best_time*1e9/n_reads,
+					n_reads/best_time/1e6, match ? "" : "(MISMATCH)");
+		}
+		// one-permutation min-hash (a different signature, not compared against the kernels)
+		VectorMinHash bins(h);
+		double best_time = 0;
+		for(uint32 p = 0; p < MINHASH_BENCH_PASSES; p++) {
+			double start_time = omp_get_wtime();
+			for(uint32 i = 0; i < n_reads; i++) {
+				oph_sketch(&kmer_hashes[read_offsets[i]], read_n_kmers[i], h, &bins[0], &min_hashes[(uint64) i*h]);
+			}
+			const double t = omp_get_wtime() - start_time;
+			if(p == 0 || t < best_time) best_time = t;
+		}
+		printf("h = %u: %-7s %8.1f ns/read %8.2f M reads/sec\n", h, "oph", best_time*1e9/n_reads, n_reads/best_time/1e6);
+	}
+}